@@ -2,10 +2,11 @@
 #include <fstream>
 #include <string>
 #include <vector>
-#include <queue>
 #include <utility>
 #include <chrono>
-#include <random>
+#include <sstream>
+#include <algorithm>
+#include <thread>
 #include <experimental/filesystem>
 //#include <filesystem>
 #include <boost/program_options.hpp>
@@ -17,19 +18,113 @@ namespace po = boost::program_options;
 #include "bam_writer.hpp"
 #include "bam_record.hpp"
 #include "bed_writer.hpp"
+#include "text_sink.hpp"
+#include "read_filter.hpp"
+#include "count_matrix.hpp"
+#include "scatter_gather.hpp"
+#include "cluster_buffer.hpp"
+#include "umi_norm_lib.hpp"
+#include "run_planner.hpp"
+#include "cluster_index.hpp"
+#include "piece_concat.hpp"
+#include "coordinate_buffer.hpp"
 
 class args_c {
     public:
         po::options_description desc;
+        std::string mode_str;
+        unsigned int num_parts;
+        std::string cluster_str;
         std::string infile_str;
         std::string outdir_str;
         std::string prefix_str;
         std::string coll_str;
+        unsigned int brake_gap;
+        std::string ref_rules_str;
+        std::string sweep_gaps_str;
+        std::string outfile_str;
+        std::string in_format_str;
+        std::string out_format_str;
+        std::string ref_str;
+        bool cram_out = false;
+        bool stream_coordinate = false;
+        bool from_sorted = false;
+        bool sort_u = false;
+        bool compress_text = false;
+        std::string previous_sorted_str;
+        unsigned int exclude_flags;
+        unsigned int min_mapq;
+        std::string include_refs_str;
+        std::string exclude_refs_str;
+        std::string cell_regex_str;
+        std::string rep_policy;
+        unsigned int seed;
+        unsigned int umi_len;
         unsigned int size_lim_M;
+        unsigned int num_threads;
+        unsigned int max_fan_in;
+        double mem_factor;
         bool parse_args(int argc, char* argv[]); 
         void print_help();
 };
 
+// Outputs of the collapse with one gap of the sweep
+struct sweep_outputs {
+    int brake_gap = 0;
+    std::string u_str;
+    std::string bed_str;
+    std::unique_ptr<bam_writer> writer;
+    std::unique_ptr<bed_writer> bwriter;
+    std::unique_ptr<count_matrix> matrix;
+    long u_start = -1;
+};
+
+// Outputs of one key range of the final pass. Range 0 writes the final
+// files; range p > 0 writes pieces into the logdir that are appended to
+// them once the pass is done.
+struct collapse_outputs {
+    std::string u_str;
+    std::string sorted_str;
+    std::string bed_str;
+    std::string gap_str;
+    std::string log_str;
+    std::string coll_len_str;
+    std::string index_str;
+    std::unique_ptr<bam_writer> writer;
+    std::unique_ptr<bam_writer> writer_sorted;
+    std::unique_ptr<bed_writer> bwriter;
+    std::unique_ptr<text_sink> gwriter;
+    std::unique_ptr<text_sink> outfile_log;
+    std::unique_ptr<text_sink> coll_len;
+    std::unique_ptr<cluster_index_writer> cluster_idx;
+    std::unique_ptr<count_matrix> matrix;
+    // Path prefix of the sweep outputs, <prefix>_gap<gap>_*
+    std::string sweep_prefix;
+    std::vector<sweep_outputs> sweeps;
+    // Virtual offsets of the first records of the bam outputs
+    long u_start = -1;
+    long sorted_start = -1;
+    // Offset in the sorted bam of the first read of the current cluster;
+    // the engine reports a cluster before the first read of the next one.
+    long cluster_offset = -1;
+    bool cluster_start = true;
+
+    // Flushes and closes the files; the matrix is kept.
+    void close() {
+        writer.reset();
+        writer_sorted.reset();
+        bwriter.reset();
+        gwriter.reset();
+        outfile_log.reset();
+        coll_len.reset();
+        cluster_idx.reset();
+        for (sweep_outputs& lsweep : sweeps) {
+            lsweep.writer.reset();
+            lsweep.bwriter.reset();
+        }
+    }
+};
+
 class uminorm {
     private:
         std::string infile_str;
@@ -41,53 +136,94 @@ class uminorm {
         std::string logdir_str;
         std::string prefix_str;
         std::string coll_str;
-        int total_split_count = 0;
+        int brake_gap;
+        std::string ref_rules_str;
+        std::string sweep_gaps_str;
+        std::vector<int> sweep_gaps;
+        std::string in_format_str;
+        std::string out_format_str;
+        std::string ref_str;
+        bool cram_out;
+        bool stream_coordinate;
+        bool from_sorted;
+        bool sort_u;
+        bool compress_text;
+        std::string previous_sorted_str;
+        std::string include_refs_str;
+        std::string exclude_refs_str;
+        std::string cell_regex_str;
+        std::string rep_policy;
+        unsigned int seed;
+        unsigned int umi_len;
+        read_filter filter;
         bam_reader obj;
         unsigned int size_lim_M;
         unsigned long size_lim;
-        int brake_gap = 500;
+        unsigned int num_threads;
+        unsigned int max_fan_in;
+        double mem_factor;
+        // Reads decoded per call of read_batch
+        size_t batch_size = 4096;
         bam_hdr_t* lhdr = NULL;
-        unsigned seed = 100;
-        std::default_random_engine generator;
+        // Representatives of all ranges with --sort_u, written at the end
+        std::unique_ptr<coordinate_buffer> u_buffer;
     public:
         uminorm(args_c args_o);
-        int get_rand_pos(int vec_size);
-        std::string get_temp_file(unsigned int count); 
-        void dump_sorted_records (std::vector<bam_record> brvec, 
-            unsigned int temp_count, bam_hdr_t* lhdr);
-        bool will_break_feature(bam_record first_rec, bam_record last_rec, bam_record this_rec);
-        bool will_break_coordinate(bam_record first_rec, bam_record last_rec, bam_record this_rec);
-        bool will_break(bam_record first_record, bam_record last_record, bam_record this_record, std::string coll_type);
-        void write_collapse(std::vector<bam_record>& local_vec, std::ofstream& coll_writer, std::ofstream& coll_len,  int final_pos);
-        void split_n_sort_files();
-        void merge_files();
+        void write_collapse(cluster_buffer& local_vec, text_sink& coll_writer, text_sink& coll_len,  int final_pos);
         void main_func();
         bool parse_args(int argc, char* argv[]);
         void print_help();
         std::string get_outfile_suffix_path(std::string suf);
         void initialize();
-        void clean();
-        std::string get_bed_str(std::vector<bam_record> local_vec);
-        void throw_ineq_exception(std::string first_str, std::string sec_str);
+        void write_bed(text_sink& bed_sink, const bam_record& first_rec,
+            const bam_record& last_rec);
+        void throw_ineq_exception(const char* first_str, const char* sec_str);
+        void throw_ineq_exception(long first_val, long sec_val);
         void throw_neg_execption(long lvar);
 
-        std::string get_gap_str(const bam_record& first_rec, 
+        void write_gap(text_sink& gap_sink, const bam_record& first_rec,
             const bam_record& last_rec);
 
-        bool will_write_gap_coordinate(bam_record last_rec, 
-            bam_record this_rec);
+        void open_outputs(collapse_outputs& lout);
+        part_callbacks get_callbacks(collapse_outputs& lout);
+        bool has_bam_outfile();
+        bool can_split_outputs();
+        void write_sorted_u();
+        void append_pieces(std::vector<std::unique_ptr<collapse_outputs>>& outputs);
 
 };
 
 uminorm::uminorm(args_c args_o)
     : infile_str(args_o.infile_str),
+    outfile_str(args_o.outfile_str),
     outdir_str(args_o.outdir_str),
     prefix_str(args_o.prefix_str),
     coll_str(args_o.coll_str),
+    brake_gap(args_o.brake_gap),
+    ref_rules_str(args_o.ref_rules_str),
+    sweep_gaps_str(args_o.sweep_gaps_str),
+    in_format_str(args_o.in_format_str),
+    out_format_str(args_o.out_format_str),
+    ref_str(args_o.ref_str),
+    cram_out(args_o.cram_out),
+    stream_coordinate(args_o.stream_coordinate),
+    from_sorted(args_o.from_sorted),
+    sort_u(args_o.sort_u),
+    compress_text(args_o.compress_text),
+    previous_sorted_str(args_o.previous_sorted_str),
+    include_refs_str(args_o.include_refs_str),
+    exclude_refs_str(args_o.exclude_refs_str),
+    cell_regex_str(args_o.cell_regex_str),
+    rep_policy(args_o.rep_policy),
+    seed(args_o.seed),
+    umi_len(args_o.umi_len),
+    filter(args_o.exclude_flags, args_o.min_mapq),
+    obj(infile_str, in_format_str, ref_str),
     size_lim_M(args_o.size_lim_M),
-    obj(infile_str),
-    generator(seed) {
-        size_lim = size_lim_M * 1000000;    
+    num_threads(args_o.num_threads),
+    max_fan_in(args_o.max_fan_in),
+    mem_factor(args_o.mem_factor) {
+        size_lim = (unsigned long) size_lim_M * 1000000;
     }
 
 std::string uminorm::get_outfile_suffix_path(std::string suf) {
@@ -96,99 +232,27 @@ std::string uminorm::get_outfile_suffix_path(std::string suf) {
 
 }
 
-std::string uminorm::get_temp_file(unsigned int count) {
-
-    std::string res = logdir_str + "/" + prefix_str + "_" + std::to_string(count) + ".bam";
-    return res;
-}
-
-void uminorm::dump_sorted_records (std::vector<bam_record> brvec, 
-        unsigned int temp_count, bam_hdr_t* lhdr) {
-    std::sort(brvec.begin(), brvec.end(), compare_bam_less());
-    std::string temp_str = get_temp_file(temp_count);
-    bam_writer writer(temp_str, lhdr);
-    std::cout << "Dumping data to file: " << temp_str << "\n";
-    std::cout << "Vector size: " << brvec.size() << "\n";
-    for(const bam_record& lrecord: brvec) {
-        writer.write_record(lrecord.full_rec);
-    }
-}
-
-bool uminorm::will_break_coordinate(bam_record first_rec, bam_record last_rec, bam_record this_rec) {
-    // Compare between last_rec and this_rec; in some cases first rec and
-    // last_rec would be identical.
-
-    // We should change this gap
-    if (last_rec.ref_name_id != this_rec.ref_name_id) {
-        return true;
-    } else if (0 != strcmp(last_rec.umi, this_rec.umi)) {
-        return true;
-    } else if (last_rec.strand != this_rec.strand) {
-        return true;
-    } else if ((this_rec.start_pos - last_rec.start_pos) > brake_gap) {
-        return true;
-    } else {
-        return false;
-    }
-}
-
-bool uminorm::will_write_gap_coordinate(bam_record last_rec, bam_record this_rec) {
-    // Compare between last_rec and this_rec; in some cases first rec and
-    // last_rec would be identical.
-
-    // We should change this gap
-    if (last_rec.ref_name_id != this_rec.ref_name_id) {
-        return false;
-    } else if (0 != strcmp(last_rec.umi, this_rec.umi)) {
-        return false;
-    } else if (last_rec.strand != this_rec.strand) {
-        return false;
-    } else {
-        return true;
-    }
-}
-
-bool uminorm::will_break_feature(bam_record first_rec, bam_record last_rec, bam_record this_rec) {
-    if (last_rec.ref_name_id != this_rec.ref_name_id) {
-        return true;
-    } else if (0 != strcmp(last_rec.umi, this_rec.umi)) {
-        return true;
-    } else if (last_rec.strand != this_rec.strand) {
-        return true;
-    } else {
-        return false;
-    }
-} 
-
-bool uminorm::will_break(bam_record first_record, bam_record last_record, bam_record this_record, std::string coll_type) {
-    if (0 == coll_type.compare("feature")) {
-        return will_break_feature(first_record, last_record, this_record);
-    } else if (0 == coll_type.compare("coordinate")) {
-        return will_break_coordinate(first_record, last_record, this_record);
-    } else {
-        std::string throw_msg = "Illegal umi brake option: " + coll_type;
-        throw std::runtime_error(throw_msg);
-    }
-}
-
-void uminorm::write_collapse(std::vector<bam_record>& local_vec, std::ofstream& coll_writer, std::ofstream& coll_len, int final_pos) {
+void uminorm::write_collapse(cluster_buffer& local_vec, text_sink& coll_writer, text_sink& coll_len, int final_pos) {
     // Get the last record, specifically the name of the query
 
-    bam_record& last_rec = local_vec.back();
-    std::string qname_str(last_rec.qname);
+    const bam_record& last_rec = local_vec.back();
     unsigned long startPos = local_vec.front().start_pos;
     unsigned long endPos = local_vec.back().end_pos;
     int totalReads = local_vec.size();
     int totalGap = endPos - startPos + 1;
-    std::string strand_str(1, local_vec.front().strand);
-    coll_writer << "representative read: " << qname_str << " total_reads: " << totalReads << " gap: " << totalGap << " final_pos: " << final_pos << " strand: " << strand_str << " start_pos: " << startPos << " end_pos: " << endPos << "\n";
-    coll_len << totalReads << "\n";
-     coll_writer << "------------------------------------\n";
-    for (auto& lrec : local_vec) {
-        std::string full_rec_str(lrec.full_rec);
-        coll_writer << full_rec_str << "\n";
-    }
-    coll_writer << ">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n";
+    coll_writer.put("representative read: ").put(last_rec.qname).
+        put(" total_reads: ").put_int(totalReads).
+        put(" gap: ").put_int(totalGap).
+        put(" final_pos: ").put_int(final_pos).
+        put(" strand: ").put(local_vec.front().strand).
+        put(" start_pos: ").put_uint(startPos).
+        put(" end_pos: ").put_uint(endPos).put('\n');
+    coll_len.put_int(totalReads).put('\n');
+    coll_writer.put("------------------------------------\n");
+    local_vec.for_each_full_rec([&coll_writer](const char* full_rec) {
+        coll_writer.put(full_rec).put('\n');
+    });
+    coll_writer.put(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n");
 }
 
 void uminorm::initialize() {
@@ -197,11 +261,39 @@ void uminorm::initialize() {
         fs::create_directories(outdir_path);
     }
 
+    std::istringstream gaps_stream(sweep_gaps_str);
+    std::string lgap_str;
+    while (std::getline(gaps_stream, lgap_str, ',')) {
+        if (lgap_str.empty() ||
+            lgap_str.find_first_not_of("0123456789") != std::string::npos) {
+            throw std::runtime_error("Illegal gap in sweep_gaps: " + lgap_str);
+        }
+        sweep_gaps.push_back(std::stoi(lgap_str));
+    }
+    std::sort(sweep_gaps.begin(), sweep_gaps.end());
+    sweep_gaps.erase(std::unique(sweep_gaps.begin(), sweep_gaps.end()),
+        sweep_gaps.end());
+
     lhdr = obj.get_sam_header();
+    filter.set_refs(lhdr, include_refs_str, exclude_refs_str);
+    obj.set_filter(&filter);
+
+    run_planner planner(infile_str, in_format_str, ref_str, &filter, umi_len);
+    run_plan plan = planner.make_plan(size_lim_M, num_threads, max_fan_in,
+        mem_factor);
+    plan.print();
+    size_lim = plan.size_lim;
+    num_threads = plan.num_threads;
+    max_fan_in = plan.max_fan_in;
+
     // Outdir would be those place dedicated specifically for UMI
-    outfile_str = outdir_str + "/" + prefix_str + "_u.bam";
-    bedfile_str = outdir_str + "/" + prefix_str + ".bed";
-    gapfile_str = outdir_str + "/" + prefix_str + "_gap.txt";
+    std::string out_suffix = cram_out ? ".cram" : ".bam";
+    if (outfile_str.empty()) {
+        outfile_str = outdir_str + "/" + prefix_str + "_u" + out_suffix;
+    }
+    std::string text_suffix = compress_text ? ".gz" : "";
+    bedfile_str = outdir_str + "/" + prefix_str + ".bed" + text_suffix;
+    gapfile_str = outdir_str + "/" + prefix_str + "_gap.txt" + text_suffix;
     logdir_str = outdir_str + "/logdir";
     
     fs::path logdir_path (logdir_str);
@@ -210,200 +302,25 @@ void uminorm::initialize() {
     }
 }
 
-void uminorm::split_n_sort_files() {
-
-
-    // We duplicate the sam header to keep it alive after this function exits.
-    // ideally we have to have a copy constructor for bam_reader.
-
-    // if the outdir does not exists, create it
-
-    unsigned long read_counter = 0;
-    unsigned int split_count = 0;
-    while(true) {
-        std::string ret_str;
-        std::vector<bam_record> brvec;
-        unsigned long used_size = 0;
-        bam_record next_rec;
-
-        while(!(ret_str = obj.read_record(next_rec)).empty()) {
-            read_counter++;
-            if (read_counter %100000 == 0) {
-                std::cout << "The value of read_counter: " << std::to_string(read_counter) << "\n";
-                std::cout << "ret_str: ---" << ret_str << "---\n";
-            }
-            if (next_rec.is_mapped) {
-                const int lsize = next_rec.get_size();
-                //std::cout << "lsize: " << lsize << " used_size: " << used_size << "\n";
-                used_size += lsize;
-                brvec.push_back(std::move(next_rec));
-                if (used_size > size_lim) {
-                    split_count++;
-                    dump_sorted_records(brvec, split_count, lhdr); 
-                    std::cout << "split_count: " << std::to_string(split_count) << "\n";
-                    break;
-                }
-            }
-        }
-        std::cout << "Reached out of the while loop" << "\n"; 
-        if (ret_str.empty()) {
-            if (used_size > 0) {
-                split_count++;
-                dump_sorted_records(brvec, split_count, lhdr);
-                    std::cout << "split_count: " << std::to_string(split_count) << "\n";
-            }
-            break;
-        }
-    }
-    total_split_count = split_count;
-    std::cout << "Reached end of split and sort" << "\n"; 
-
-}
-
-int uminorm::get_rand_pos(int vec_size) {
-    if (vec_size == 1) {
-        return 0;
-    } else {
-        int vec_size_t = vec_size - 1;
-        std::uniform_int_distribution<int> distribution(0, vec_size_t);
-        return distribution(generator);
-        
-    }
-}
-
-
-void uminorm::merge_files() {
-
-    std::map<unsigned int, bam_reader> reader_map;
-    std::priority_queue<bam_record, std::vector<bam_record>, compare_bam_greater> bam_pq;
-
-    for (unsigned int j = 1; j <= total_split_count; j++) {
-        std::string temp_str = get_temp_file(j);
-        std::cout << "Opening tempfile for reading: " << temp_str << "\n";
-        //reader_map.emplace(j, temp_str);
-        reader_map.emplace(j, temp_str);
-        // Get the first read; it is expected that the first read would 
-        // be useful.
-        bam_record lrec;
-        reader_map[j].read_record(lrec);
-        lrec.reader_index = j;
-        bam_pq.push(std::move(lrec));
-    } 
-
-    std::cout << "Size of priority queue: " << bam_pq.size() << "\n";
-
-    // Create the final writer
-    // Get the header from the first object and use it for creating the 
-    // header of output
-    //bam_hdr_t* lhdr = reader_map[1].get_sam_header();
-    //std::set<unsigned int> empty_readers;
-    std::string outfile_log_str = get_outfile_suffix_path("_log.txt");
-    std::string sorted_bam_str = get_outfile_suffix_path("_sorted.bam");
-    std::string coll_len_str = get_outfile_suffix_path("_coll_len.txt");
-    bam_writer writer(outfile_str, lhdr);
-
-    bed_writer bwriter(bedfile_str);
-
-    std::ofstream gwriter(gapfile_str);
-
-    std::cout << "sorted_sam_str: " << sorted_bam_str << "\n";
-    bam_writer writer_sorted(sorted_bam_str, lhdr);
-
-    bam_record first_record;
-    bam_record last_record;   
-    std::vector<bam_record> local_vec;
-    std::ofstream outfile_log(outfile_log_str);
-    std::ofstream coll_len(coll_len_str);
- 
-    bool fresh_start = true;
-    unsigned long lcount = 0;
-    while(!bam_pq.empty()) {
-        bam_record lrec = bam_pq.top();
-        //std::cout << "full_rec: " << std::string(lrec.full_rec) << ", is_mapped: " << std::boolalpha << lrec.is_mapped << "\n";
-        if (lrec.is_mapped) {
-            lcount++;
-            if (fresh_start) {
-                // If this is the first record, please record all the information.
-                first_record = lrec;
-                last_record = lrec;
-                fresh_start = false;
-                local_vec.push_back(lrec);
-            } else {
-
-                // Get the gap between lrec and last_record
-                // Get the starting position between lrec and last_record
-                // Here last_record is actually the first record which is 
-                // on the left side on the coordinate and lrec is the 
-                // second record which is on the right side of the coordinate.
-
-                if (will_write_gap_coordinate(last_record, lrec)) {
-                    std::string gap_str = get_gap_str(last_record, lrec);
-                    gwriter << gap_str << "\n";
-                }
-                
-                bool break_status = will_break(first_record, last_record, \
-                    lrec, coll_str);
-                if (!break_status) {
-                    last_record = lrec;
-                    local_vec.push_back(lrec);
-                } else {
-                    // Write bed information for the umi chain
-                    // Get the corresponding bed information
-                    std::string bed_str = get_bed_str(local_vec);
-                    bwriter.write_record_str(bed_str);
-
-                    int rand_pos = get_rand_pos(local_vec.size());
-                    bam_record final_rec = local_vec.at(rand_pos); 
-                    writer.write_record(final_rec.full_rec);
-                    write_collapse(local_vec, outfile_log, coll_len, rand_pos);
-                    local_vec.clear();
-                    first_record = lrec;
-                    last_record = lrec;
-                    local_vec.push_back(lrec);
-                }
-            }
-            writer_sorted.write_record(lrec.full_rec);
-        }
-        unsigned int reader_index = lrec.reader_index;
-        bam_pq.pop();
-        // Write it to the outfile
-        // get the index of the lrec and get one from that reader
-        // 
-        bam_record lrec_new;
-        std::string ret = reader_map[reader_index].read_record(lrec_new);
-        if (!ret.empty()) {
-            // transfer the reader_index
-            lrec_new.reader_index = reader_index;
-            bam_pq.push(std::move(lrec_new));
-        }
-    }
-
-    // Check if local_vec has something; if yes push the last read
-    if (!local_vec.empty()) {
-        
-        // Get the corresponding bed information
-        std::string bed_str = get_bed_str(local_vec);
-        bwriter.write_record_str(bed_str);
+// This would take the first and the last bam record from local_vec. We
+// assume that they represent the two ends of a isolated UMI chain.
 
-        // This works as the last break point
-        int rand_pos = get_rand_pos(local_vec.size());
-        bam_record final_rec = local_vec.at(rand_pos);
-        writer.write_record(final_rec.full_rec);
-        write_collapse(local_vec, outfile_log, coll_len, rand_pos);
-        local_vec.clear();
+void uminorm::throw_ineq_exception(const char* first_str, const char* sec_str) {
 
+    if (strcmp(first_str, sec_str) != 0) {
+        std::string throw_msg = "First and second strings are not equal. \
+            First string: " + std::string(first_str) + ", sec_str: " +
+            std::string(sec_str);
+        throw std::runtime_error(throw_msg);
     }
-    std::cout << "mapped_count: " << lcount << "\n";
 }
 
-// This would take the first and the last bam record from local_vec. We
-// assume that they represent the two ends of a isolated UMI chain.
-
-void uminorm::throw_ineq_exception(std::string first_str, std::string sec_str) {
+void uminorm::throw_ineq_exception(long first_val, long sec_val) {
 
-    if (first_str != sec_str) {
-        std::string throw_msg = "First and second strings are not equal. \
-            First string: " + first_str + ", sec_str: " + sec_str;
+    if (first_val != sec_val) {
+        std::string throw_msg = "First and second values are not equal. \
+            First value: " + std::to_string(first_val) + ", sec_val: " +
+            std::to_string(sec_val);
         throw std::runtime_error(throw_msg);
     }
 }
@@ -417,117 +334,346 @@ void uminorm::throw_neg_execption(long lvar) {
     }
 }
 
-std::string uminorm::get_bed_str(std::vector<bam_record> local_vec) {
-    bam_record& first_rec = local_vec.front();
-    bam_record& last_rec = local_vec.back();
-
-    char first_strand = first_rec.strand;
-    char last_strand = last_rec.strand;
-    std::string first_strand_s(1, first_strand);
-    std::string last_strand_s(1, last_strand);
-    throw_ineq_exception(first_strand_s, last_strand_s);
+// Writes the bed line of a UMI chain: ref, start, end, name
+// (umi_start_end_gap), score and strand.
+void uminorm::write_bed(text_sink& bed_sink, const bam_record& first_rec,
+    const bam_record& last_rec) {
 
-    std::string first_umi_s(first_rec.umi);
-    std::string last_umi_s(last_rec.umi);
-    throw_ineq_exception(first_umi_s, last_umi_s);
+    throw_ineq_exception(first_rec.strand, last_rec.strand);
+    throw_ineq_exception(first_rec.umi, last_rec.umi);
 
     unsigned long startPos = first_rec.start_pos;
     unsigned long endPos = last_rec.end_pos;
     long totalGap = endPos - startPos + 1;
     throw_neg_execption(totalGap);
-    std::string startPos_s = std::to_string(startPos);
-    std::string endPos_s = std::to_string(endPos);
-
-    // We need strand, stratPos, endPos and umi string to create a bed record.
-    int first_ref_name_id = first_rec.ref_name_id;
-    int last_ref_name_id = last_rec.ref_name_id;
 
-    std::string first_ref_name_s = std::to_string(first_ref_name_id);
-    std::string last_ref_name_s = std::to_string(last_ref_name_id);
-
-    throw_ineq_exception(first_ref_name_s, last_ref_name_s);   
+    throw_ineq_exception(first_rec.ref_name_id, last_rec.ref_name_id);
 
     // We shall have to get the tid of one of the two alignments
-    const char* refarr = sam_hdr_tid2name(lhdr, first_ref_name_id);
-    std::string lref_s(refarr); 
-    
-    std::string lname = first_umi_s + "_" + startPos_s + "_" + endPos_s +\
-        "_" + std::to_string(totalGap);
+    const char* refarr = sam_hdr_tid2name(lhdr, first_rec.ref_name_id);
+
     int lscore = 0;
-    std::string lscore_s = std::to_string(lscore);
-    std::string bed_str = lref_s + "\t" + 
-        startPos_s + "\t" + 
-        endPos_s + "\t" + 
-        lname + "\t" + 
-        lscore_s + "\t" +
-        first_strand;
-        
-    return (bed_str);
+    bed_sink.put(refarr).put('\t').
+        put_uint(startPos).put('\t').
+        put_uint(endPos).put('\t').
+        put(first_rec.umi).put('_').put_uint(startPos).put('_').
+        put_uint(endPos).put('_').put_int(totalGap).put('\t').
+        put_int(lscore).put('\t').
+        put(first_rec.strand).put('\n');
 }
 
-std::string uminorm::get_gap_str(const bam_record& first_rec, 
+// Writes the gap line of two consecutive reads of one ref/UMI/strand.
+void uminorm::write_gap(text_sink& gap_sink, const bam_record& first_rec,
     const bam_record& last_rec) {
 
     // Check that refname, strand and UMI for next_rec and first_rec are 
-    char first_strand = first_rec.strand;
-    char last_strand = last_rec.strand;
-    std::string first_strand_s(1, first_strand);
-    std::string last_strand_s(1, last_strand);
-    throw_ineq_exception(first_strand_s, last_strand_s);
+    throw_ineq_exception(first_rec.strand, last_rec.strand);
+    throw_ineq_exception(first_rec.umi, last_rec.umi);
+    throw_ineq_exception(first_rec.ref_name_id, last_rec.ref_name_id);
 
-    std::string first_umi_s(first_rec.umi);
-    std::string last_umi_s(last_rec.umi);
-    throw_ineq_exception(first_umi_s, last_umi_s);
-
-    int first_ref_name_id = first_rec.ref_name_id;
-    int last_ref_name_id = last_rec.ref_name_id;
+    long gap_two_recs = last_rec.start_pos - first_rec.start_pos;
+    throw_neg_execption(gap_two_recs);
 
-    std::string first_ref_name_s = std::to_string(first_ref_name_id);
-    std::string last_ref_name_s = std::to_string(last_ref_name_id);
+    gap_sink.put(first_rec.umi).put('\t').
+        put(first_rec.strand).put('\t').
+        put_int(gap_two_recs).put('\t').
+        put_int(first_rec.ref_name_id).put('\t').
+        put_uint(first_rec.start_pos).put('\t').
+        put_uint(last_rec.start_pos).put('\n');
+}
 
-    throw_ineq_exception(first_ref_name_s, last_ref_name_s);   
+void uminorm::open_outputs(collapse_outputs& lout) {
+    // With --sort_u the representatives go to u_buffer instead.
+    if (!u_buffer) {
+        lout.writer.reset(new bam_writer(lout.u_str, lhdr, out_format_str, ref_str));
+        lout.u_start = lout.writer -> get_virtual_offset();
+    }
+    lout.bwriter.reset(new bed_writer(lout.bed_str, compress_text));
+    lout.gwriter.reset(new text_sink(lout.gap_str, compress_text));
+    // Without the sort there is no sorted order to write, and sorted input
+    // is its own sorted output.
+    if (!stream_coordinate && !from_sorted) {
+        std::cout << "sorted_sam_str: " << lout.sorted_str << "\n";
+        lout.writer_sorted.reset(new bam_writer(lout.sorted_str, lhdr, "", ref_str));
+        lout.sorted_start = lout.writer_sorted -> get_virtual_offset();
+    }
+    lout.outfile_log.reset(new text_sink(lout.log_str, compress_text));
+    lout.coll_len.reset(new text_sink(lout.coll_len_str, compress_text));
+    // Clusters of the coordinate stream are not in the sorted order.
+    lout.cluster_idx.reset(new cluster_index_writer(lout.index_str,
+        lout.writer_sorted ? lout.sorted_str : "", lout.u_str,
+        !stream_coordinate));
+    lout.matrix.reset(new count_matrix(cell_regex_str));
+
+    std::string out_suffix = cram_out ? ".cram" : ".bam";
+    std::string text_suffix = compress_text ? ".gz" : "";
+    for (int lgap : sweep_gaps) {
+        lout.sweeps.emplace_back();
+        sweep_outputs& lsweep = lout.sweeps.back();
+        std::string gap_prefix = lout.sweep_prefix + "_gap" + std::to_string(lgap);
+        lsweep.brake_gap = lgap;
+        lsweep.u_str = gap_prefix + "_u" + out_suffix;
+        lsweep.bed_str = gap_prefix + ".bed" + text_suffix;
+        lsweep.writer.reset(new bam_writer(lsweep.u_str, lhdr, "", ref_str));
+        lsweep.u_start = lsweep.writer -> get_virtual_offset();
+        lsweep.bwriter.reset(new bed_writer(lsweep.bed_str, compress_text));
+        lsweep.matrix.reset(new count_matrix(cell_regex_str));
+    }
+}
 
-    // We shall have to get the tid of one of the two alignments
-    const char* refarr = sam_hdr_tid2name(lhdr, first_ref_name_id);
-    std::string lref_s(refarr); 
-    
-    unsigned long first_start_pos = first_rec.start_pos;
-    unsigned long last_start_pos = last_rec.start_pos;
-    std::string first_start_pos_s = std::to_string(first_start_pos);
-    std::string last_start_pos_s = std::to_string(last_start_pos);
+part_callbacks uminorm::get_callbacks(collapse_outputs& lout) {
+    part_callbacks callbacks;
+    // Every mapped read goes to the sorted bam, and the gap to the previous
+    // read of the same ref/UMI/strand goes to the gap file.
+    if (lout.writer_sorted) {
+        callbacks.record_cb = [&lout](const bam_record& lrec) {
+            if (lout.cluster_start) {
+                lout.cluster_offset = lout.writer_sorted -> get_virtual_offset();
+                lout.cluster_start = false;
+            }
+            lout.writer_sorted -> write_record(lrec.full_rec);
+        };
+    }
+    callbacks.gap_cb = [this, &lout](const bam_record& last_record,
+        const bam_record& lrec) {
+        write_gap(*lout.gwriter, last_record, lrec);
+    };
+
+    callbacks.cluster_cb = [this, &lout](cluster_buffer& local_vec, int rand_pos) {
+        // Write bed information for the umi chain
+        write_bed(lout.bwriter -> get_sink(), local_vec.front(), local_vec.back());
+
+        // The sorted _u.bam is written after the merge, so its offsets are
+        // not known here.
+        long u_offset = -1;
+        if (u_buffer) {
+            u_buffer -> add(local_vec.get_full_rec(rand_pos).c_str());
+        } else {
+            u_offset = lout.writer -> get_virtual_offset();
+            lout.writer -> write_record(local_vec.get_full_rec(rand_pos));
+        }
+        write_collapse(local_vec, *lout.outfile_log, *lout.coll_len, rand_pos);
+        lout.cluster_idx -> add(lhdr, local_vec.front(), local_vec.back(),
+            local_vec.size(), lout.cluster_offset, u_offset);
+        lout.cluster_offset = -1;
+        lout.cluster_start = true;
+
+        const bam_record& first_rec = local_vec.front();
+        lout.matrix -> add_cluster(first_rec.ref_name_id, first_rec.qname);
+    };
+
+    // The sweep gaps only get the bed, the representatives and the counts.
+    callbacks.sweep_cb = [this, &lout](unsigned int sweep,
+        cluster_buffer& local_vec, int rand_pos) {
+        sweep_outputs& lsweep = lout.sweeps[sweep];
+        write_bed(lsweep.bwriter -> get_sink(), local_vec.front(), local_vec.back());
+        lsweep.writer -> write_record(local_vec.get_full_rec(rand_pos));
+        const bam_record& first_rec = local_vec.front();
+        lsweep.matrix -> add_cluster(first_rec.ref_name_id, first_rec.qname);
+    };
+    return callbacks;
+}
 
-    long gap_two_recs = last_start_pos - first_start_pos;
-    throw_neg_execption(gap_two_recs);
-    std::string gap_two_recs_str = std::to_string(gap_two_recs);
+bool uminorm::has_bam_outfile() {
+    if (cram_out || outfile_str == "-") {
+        return false;
+    }
+    if (!out_format_str.empty()) {
+        return out_format_str == "bam";
+    }
+    return obj.has_suffix(outfile_str, "bam");
+}
 
-    std::string gap_str = first_umi_s + "\t" +
-        first_strand_s + "\t" +
-        gap_two_recs_str + "\t" +
-        first_ref_name_s + "\t" +
-        first_start_pos_s + "\t" +
-        last_start_pos_s;
+// The pieces of a parallel final pass are appended as raw bgzf blocks,
+// which needs bam files for both bam outputs.
+bool uminorm::can_split_outputs() {
+    if (stream_coordinate || from_sorted) {
+        return false;
+    }
+    return has_bam_outfile();
+}
 
-    return (gap_str);
+// Writes the representatives collected in u_buffer into a coordinate
+// sorted _u.bam and indexes it while it is written.
+void uminorm::write_sorted_u() {
+    // The writer keeps a copy of the header.
+    bam_hdr_t* lsorted_hdr = coordinate_buffer::get_coordinate_header(lhdr);
+    bam_writer writer(outfile_str, lsorted_hdr, "bam");
+    bam_hdr_destroy(lsorted_hdr);
+    std::string idx_str = writer.init_index(outfile_str);
+    unsigned long lcount = u_buffer -> write(writer);
+    writer.save_index();
+    std::cout << "Wrote " << lcount << " representatives by coordinate, "
+        "index: " << idx_str << "\n";
+    u_buffer.reset();
 }
 
-void uminorm::clean() {
-    for (unsigned int j = 1; j <= total_split_count; j++) {
-        std::string temp_str = get_temp_file(j);
-        
-        fs::path temp_path(temp_str);
-        bool n = fs::remove(temp_path);
-        std::cout << "Deleted: " << temp_str << "\n";
+void uminorm::append_pieces(std::vector<std::unique_ptr<collapse_outputs>>& outputs) {
+    collapse_outputs& lfirst = *outputs[0];
+    for (size_t p = 1; p < outputs.size(); p++) {
+        collapse_outputs& lpiece = *outputs[p];
+        long u_shift = 0;
+        if (!u_buffer) {
+            u_shift = piece_concat::append_bgzf(lfirst.u_str, lpiece.u_str,
+                lpiece.u_start);
+            fs::remove(lpiece.u_str);
+        }
+        long sorted_shift = piece_concat::append_bgzf(lfirst.sorted_str,
+            lpiece.sorted_str, lpiece.sorted_start);
+        piece_concat::append_cluster_index(lfirst.index_str, lpiece.index_str,
+            sorted_shift, u_shift);
+        piece_concat::append_text(lfirst.bed_str, lpiece.bed_str);
+        piece_concat::append_text(lfirst.gap_str, lpiece.gap_str);
+        piece_concat::append_text(lfirst.log_str, lpiece.log_str);
+        piece_concat::append_text(lfirst.coll_len_str, lpiece.coll_len_str);
+        lfirst.matrix -> add(*lpiece.matrix);
+        for (const std::string& lpath : {lpiece.sorted_str,
+            lpiece.index_str, lpiece.bed_str, lpiece.gap_str, lpiece.log_str,
+            lpiece.coll_len_str}) {
+            fs::remove(lpath);
+        }
+        for (size_t j = 0; j < lpiece.sweeps.size(); j++) {
+            sweep_outputs& lsweep = lfirst.sweeps[j];
+            sweep_outputs& lsweep_piece = lpiece.sweeps[j];
+            piece_concat::append_bgzf(lsweep.u_str, lsweep_piece.u_str,
+                lsweep_piece.u_start);
+            piece_concat::append_text(lsweep.bed_str, lsweep_piece.bed_str);
+            lsweep.matrix -> add(*lsweep_piece.matrix);
+            fs::remove(lsweep_piece.u_str);
+            fs::remove(lsweep_piece.bed_str);
+        }
+    }
+    if (outputs.size() > 1) {
+        std::cout << "Appended " << (outputs.size() - 1) << " pieces of the "
+            "parallel merge\n";
     }
 }
 
 void uminorm::main_func() {
-    split_n_sort_files();
-    merge_files();
+
+    std::string text_suffix = compress_text ? ".gz" : "";
+    std::string sorted_bam_str = get_outfile_suffix_path(cram_out ?
+        "_sorted.cram" : "_sorted.bam");
+    // The new sorted bam would overwrite the previous one while it is read.
+    if (!previous_sorted_str.empty() && fs::exists(sorted_bam_str) &&
+        fs::equivalent(previous_sorted_str, sorted_bam_str)) {
+        throw std::runtime_error("The previous sorted bam is the sorted "
+            "output of this run; use a different outdir or prefix: " +
+            previous_sorted_str);
+    }
+    if (stream_coordinate && (!lhdr -> text ||
+        !strstr(lhdr -> text, "SO:coordinate"))) {
+        std::cout << "Warning: the header does not declare SO:coordinate; "
+            "unsorted input will be rejected.\n";
+    }
+
+    std::vector<std::unique_ptr<collapse_outputs>> outputs;
+    outputs.emplace_back(new collapse_outputs());
+    collapse_outputs& lfirst = *outputs[0];
+    lfirst.u_str = outfile_str;
+    lfirst.sorted_str = sorted_bam_str;
+    lfirst.bed_str = bedfile_str;
+    lfirst.gap_str = gapfile_str;
+    lfirst.log_str = get_outfile_suffix_path("_log.txt" + text_suffix);
+    lfirst.coll_len_str = get_outfile_suffix_path("_coll_len.txt" + text_suffix);
+    lfirst.index_str = outdir_str + "/" + prefix_str + "_clusters.tsv";
+    lfirst.sweep_prefix = outdir_str + "/" + prefix_str;
+    if (sort_u) {
+        if (!has_bam_outfile()) {
+            throw std::runtime_error("--sort_u needs a bam file as _u output: " +
+                outfile_str);
+        }
+        // A quarter of the cluster memory of the merge
+        u_buffer.reset(new coordinate_buffer(lhdr, logdir_str + "/" +
+            prefix_str + "_u", size_lim / 8));
+    }
+    open_outputs(lfirst);
+
+    umi_norm_config config;
+    config.coll_str = coll_str;
+    config.brake_gap = brake_gap;
+    config.ref_rules = ref_rules_str;
+    config.sweep_gaps = sweep_gaps;
+    config.rep_policy = rep_policy;
+    config.seed = seed;
+    config.umi_len = umi_len;
+    config.size_lim = size_lim;
+    config.reserved_cluster_mem = u_buffer ? size_lim / 8 : 0;
+    config.num_threads = num_threads;
+    config.max_fan_in = max_fan_in;
+    config.temp_prefix = logdir_str + "/" + prefix_str;
+    config.stream_coordinate = stream_coordinate;
+    config.presorted = from_sorted;
+    config.previous_sorted = previous_sorted_str;
+    config.ref_str = ref_str;
+    config.previous_filter = &filter;
+    config.merge_parts = can_split_outputs() ? num_threads : 1;
+    umi_norm_engine engine(config, lhdr);
+
+    // Range p > 0 of a parallel final pass writes <logdir>/<prefix>_piece<p>_*.
+    engine.set_part_factory([&](unsigned int part) {
+        if (part == 0) {
+            return get_callbacks(lfirst);
+        }
+        outputs.emplace_back(new collapse_outputs());
+        collapse_outputs& lout = *outputs.back();
+        std::string piece_str = "_piece" + std::to_string(part);
+        lout.u_str = get_outfile_suffix_path(piece_str + "_u.bam");
+        lout.sorted_str = get_outfile_suffix_path(piece_str + "_sorted.bam");
+        lout.bed_str = get_outfile_suffix_path(piece_str + ".bed" + text_suffix);
+        lout.gap_str = get_outfile_suffix_path(piece_str + "_gap.txt" + text_suffix);
+        lout.log_str = get_outfile_suffix_path(piece_str + "_log.txt" + text_suffix);
+        lout.coll_len_str = get_outfile_suffix_path(piece_str + "_coll_len.txt" +
+            text_suffix);
+        lout.index_str = get_outfile_suffix_path(piece_str + "_clusters.tsv");
+        lout.sweep_prefix = get_outfile_suffix_path(piece_str);
+        open_outputs(lout);
+        return get_callbacks(lout);
+    });
+
+    unsigned long read_counter = 0;
+    bam_batch batch(batch_size, umi_len);
+    while (obj.read_batch(batch) > 0) {
+        for (size_t i = 0; i < batch.size(); i++) {
+            read_counter++;
+            if (!batch.is_mapped[i]) {
+                continue;
+            }
+            bam_record next_rec;
+            bam_reader::decode_batch_record(lhdr, batch, i, next_rec);
+            if (read_counter %100000 == 0) {
+                std::cout << "The value of read_counter: " << std::to_string(read_counter) << "\n";
+                std::cout << "ret_str: ---" << next_rec.full_rec << "---\n";
+            }
+            engine.add_record(std::move(next_rec));
+        }
+    }
+    std::cout << "Reached out of the while loop" << "\n"; 
+    std::cout << "Filtered reads: " << std::to_string(obj.get_filtered_count()) << "\n";
+    engine.finish();
+    for (std::unique_ptr<collapse_outputs>& lout : outputs) {
+        lout -> close();
+    }
+    append_pieces(outputs);
+    if (u_buffer) {
+        write_sorted_u();
+    }
+    lfirst.matrix -> write(outdir_str + "/" + prefix_str, lhdr);
+    for (sweep_outputs& lsweep : lfirst.sweeps) {
+        lsweep.matrix -> write(outdir_str + "/" + prefix_str + "_gap" +
+            std::to_string(lsweep.brake_gap), lhdr);
+    }
 }
 
 void args_c::print_help() {
     std::cout << desc << "\n";
     std::cout << "Usage: umi_norm -i <infile> -o <outdir> -p <prefix> -c <collapse_type>"
+    "\n"
+    "       umi_norm -m scatter -i <infile> -o <outdir> -p <prefix> -n <num_parts>"
+    "\n"
+    "       umi_norm -m gather -o <outdir> -p <prefix> -n <num_parts>"
+    "\n"
+    "       umi_norm -m lookup -o <outdir> -p <prefix> --cluster <ref>:<umi>:<strand>"
     "\n\n";
 }
 
@@ -536,12 +682,81 @@ bool args_c::parse_args(int argc, char* argv[]) {
     bool all_set = true;
     desc.add_options()
         ("help,h", "produce help message")
+        ("mode,m", po::value<std::string>(&mode_str)->default_value("full"),
+            "full, scatter (split the input by UMI into partitions), "
+            "gather (concatenate the outputs of the partitions) or lookup "
+            "(print the reads of a cluster).")
+        ("cluster", po::value<std::string>(&cluster_str),
+            "Cluster printed by lookup, as <ref>:<umi>:<strand>.")
+        ("num_parts,n", po::value(&num_parts)->default_value(0),
+            "Number of partitions of scatter and gather.")
         ("infile,i", po::value<std::string>(&infile_str), "Input sam/bam file.")
         ("prefix,p", po::value<std::string>(&prefix_str), "Prefix.")
         ("outdir,o", po::value<std::string>(&outdir_str), "Output directory.")
         ("collapse_type,c", po::value<std::string>(&coll_str), "Type of collapse.")
-        ("size_lim_M,s", po::value(&size_lim_M)->default_value(200),
-            "Size of memory in megabyte")
+        ("brake_gap", po::value(&brake_gap)->default_value(500),
+            "Gap in bases between consecutive reads of a UMI/strand that "
+            "breaks a coordinate cluster.")
+        ("ref_collapse", po::value<std::string>(&ref_rules_str),
+            "Collapse of some references instead of -c, as a comma separated "
+            "list of <name>=<mode>[:<gap>]; a name ending with * is a prefix "
+            "(e.g. 'chr*=feature,NC_*=coordinate:500').")
+        ("outfile,u", po::value<std::string>(&outfile_str),
+            "Deduplicated sam/bam output, - for stdout (default: <outdir>/<prefix>_u.bam).")
+        ("in_format", po::value<std::string>(&in_format_str),
+            "Format of the input (sam, bam or cram); needed when it has no suffix.")
+        ("out_format", po::value<std::string>(&out_format_str),
+            "Format of the deduplicated output (sam, bam or cram).")
+        ("reference,r", po::value<std::string>(&ref_str),
+            "Fasta reference for reading and writing cram.")
+        ("cram_out", po::bool_switch(&cram_out),
+            "Write the _sorted and _u outputs as cram.")
+        ("compress_text", po::bool_switch(&compress_text),
+            "Write the bed, gap and log outputs bgzf compressed (.gz).")
+        ("previous_sorted", po::value<std::string>(&previous_sorted_str),
+            "_sorted.bam of an earlier run over the same references; its "
+            "reads are merged with the input without sorting them again.")
+        ("sweep_gaps", po::value<std::string>(&sweep_gaps_str),
+            "Comma separated further gaps, collapsed over the same sorted "
+            "reads; each writes <prefix>_gap<gap>_u.bam, .bed and counts.")
+        ("from_sorted", po::bool_switch(&from_sorted),
+            "The input is the _sorted.bam of an earlier run; it is collapsed "
+            "again (e.g. with another -c or --ref_collapse) without the sort.")
+        ("sort_u", po::bool_switch(&sort_u),
+            "Write _u.bam coordinate sorted, with a .bai index (.csi for "
+            "references over 512 Mb); the sweep outputs stay in UMI order.")
+        ("stream", po::bool_switch(&stream_coordinate),
+            "Collapse coordinate sorted input as it streams, without the "
+            "external sort (coordinate collapse only; no _sorted output).")
+        ("exclude_flags", po::value(&exclude_flags)->default_value(BAM_FUNMAP),
+            "Drop reads with any of these flag bits (4 unmapped, 256 secondary, "
+            "512 qc fail, 2048 supplementary).")
+        ("min_mapq", po::value(&min_mapq)->default_value(0),
+            "Drop reads with a lower mapping quality.")
+        ("include_refs", po::value<std::string>(&include_refs_str),
+            "Comma separated references to keep; all others are dropped.")
+        ("exclude_refs", po::value<std::string>(&exclude_refs_str),
+            "Comma separated references to drop.")
+        ("rep_policy", po::value<std::string>(&rep_policy)->default_value("hash"),
+            "Representative read of a cluster: hash, mapq, longest or random.")
+        ("seed", po::value(&seed)->default_value(100),
+            "Seed of the representative selection.")
+        ("umi_len", po::value(&umi_len)->default_value(6),
+            "Number of bases of the umi_ field of the qnames.")
+        ("cell_regex", po::value<std::string>(&cell_regex_str),
+            "Regex with one group extracting the cell barcode from the qname, "
+            "used for the columns of the count matrix.")
+        ("size_lim_M,s", po::value(&size_lim_M)->default_value(0),
+            "Size of the sorted runs in megabyte (0 to size them from the "
+            "available memory)")
+        ("threads,t", po::value(&num_threads)->default_value(0),
+            "Number of sorting threads (0 for all available cores)")
+        ("fan_in", po::value(&max_fan_in)->default_value(0),
+            "Most runs merged at once, at least 2; more runs are merged in "
+            "several passes (0 to choose from the memory)")
+        ("memory_factor", po::value(&mem_factor)->default_value(0),
+            "Memory used per byte of run size (0 to measure it on the head "
+            "of the input)")
         ;
 
         po::variables_map vm;
@@ -553,35 +768,63 @@ bool args_c::parse_args(int argc, char* argv[]) {
     } else {
     }
 
+    if (mode_str != "full" && mode_str != "scatter" && mode_str != "gather" &&
+        mode_str != "lookup") {
+        all_set = false;
+        std::cerr << "Error: illegal mode: " << mode_str << "\n";
+    }
+
+    if (mode_str == "scatter" || mode_str == "gather") {
+        if (num_parts > 0) {
+            std::cerr << "num_parts is set to " << std::to_string(num_parts) << "\n";
+        } else {
+            all_set = false;
+            std::cerr << "Error: num_parts is not set.\n";
+        }
+    }
+
     if (vm.count("infile")) {
-        std::cout << "Infile is set to: " << infile_str << "\n";
-    } else {
+        std::cerr << "Infile is set to: " << infile_str << "\n";
+    } else if (mode_str == "full" || mode_str == "scatter") {
         all_set = false;
-        std::cout << "Error: infile is not set.\n";
+        std::cerr << "Error: infile is not set.\n";
     }
 
     if (vm.count("outdir")) {
-        std::cout << "Outdir is set to " << outdir_str << "\n";
+        std::cerr << "Outdir is set to " << outdir_str << "\n";
     } else {
         all_set = false;
-        std::cout << "Error: outdir is not set.\n";
+        std::cerr << "Error: outdir is not set.\n";
     }
 
     if (vm.count("prefix")) {
-        std::cout << "Prefix is set to " << prefix_str << "\n";
+        std::cerr << "Prefix is set to " << prefix_str << "\n";
     } else {
         all_set = false;
-        std::cout << "Error: prefix is not set.\n";
+        std::cerr << "Error: prefix is not set.\n";
     }
 
     if (vm.count("collapse_type")) {
-        std::cout << "Collapse_type is set to " << coll_str << "\n";
-    } else {
+        std::cerr << "Collapse_type is set to " << coll_str << "\n";
+    } else if (mode_str == "full") {
+        all_set = false;
+        std::cerr << "Error: Collapse_type is not set.\n";
+    }
+
+    std::cerr << "size_lim_M is set to " << std::to_string(size_lim_M) << "\n";
+    std::cerr << "threads is set to " << std::to_string(num_threads) << "\n";
+
+    // A merge of one run at a time would never reduce the runs.
+    if (max_fan_in == 1) {
         all_set = false;
-        std::cout << "Error: Collapse_type is not set.\n";
+        std::cerr << "Error: fan_in has to be at least 2, or 0 to choose it "
+            "from the memory.\n";
     }
 
-    std::cout << "size_lim_M is set to " << std::to_string(size_lim_M) << "\n";
+    if (cram_out && ref_str.empty()) {
+        std::cerr << "Warning: cram_out without reference; htslib will look "
+            "up the reference through REF_PATH/REF_CACHE.\n";
+    }
     return all_set;
 
 }
@@ -603,11 +846,39 @@ int main(int argc, char** argv) {
         return 0;
     }
 
-    uminorm uno(args_o);
+    // The deduplicated reads (or the reads of a lookup) own stdout; the
+    // progress messages go to stderr. parse_args already reports to
+    // stderr, as the mode is not known before it.
+    std::ostream read_out(std::cout.rdbuf());
+    if (args_o.outfile_str == "-" || args_o.mode_str == "lookup") {
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
+
     try {
-        uno.initialize();
-        uno.main_func();
-        uno.clean();
+        if (args_o.mode_str == "scatter") {
+            bam_reader reader(args_o.infile_str, args_o.in_format_str,
+                args_o.ref_str);
+            read_filter filter(args_o.exclude_flags, args_o.min_mapq);
+            filter.set_refs(reader.get_sam_header(), args_o.include_refs_str,
+                args_o.exclude_refs_str);
+            reader.set_filter(&filter);
+            umi_scatter scatter(reader, args_o.outdir_str, args_o.prefix_str,
+                args_o.num_parts, args_o.umi_len);
+            scatter.run();
+        } else if (args_o.mode_str == "lookup") {
+            cluster_lookup lookup(args_o.outdir_str, args_o.prefix_str,
+                read_out);
+            lookup.run(args_o.cluster_str);
+        } else if (args_o.mode_str == "gather") {
+            umi_gather gather(args_o.outdir_str, args_o.prefix_str,
+                args_o.num_parts, args_o.cram_out, args_o.ref_str,
+                args_o.compress_text);
+            gather.run();
+        } else {
+            uminorm uno(args_o);
+            uno.initialize();
+            uno.main_func();
+        }
     } catch(const std::runtime_error& e) {
         std::cerr << "error: " << e.what() << "\n";
     }
@@ -0,0 +1,132 @@
+#ifndef _BAM_BATCH_HPP
+#define _BAM_BATCH_HPP
+
+#include <cstring>
+#include <vector>
+#include <htslib/sam.h>
+
+// A reusable block of raw alignments filled by bam_reader::read_batch.
+// The bam1_t slots are allocated once and reused by every batch; after a
+// read the key fields of all reads are extracted into flat arrays in one
+// pass, so that the callers can work on a whole batch at a time and only
+// materialize the reads they keep.
+class bam_batch {
+
+    public:
+
+    bam_batch(size_t capacity = 4096, size_t umi_len = 6):
+        umi_len(umi_len),
+        slots(capacity),
+        start_pos(capacity),
+        end_pos(capacity),
+        strand(capacity),
+        mapq(capacity),
+        aln_len(capacity),
+        is_mapped(capacity),
+        umi_ok(capacity),
+        umi((umi_len + 1) * capacity) {
+        for (size_t i = 0; i < capacity; i++) {
+            slots[i] = bam_init1();
+        }
+    }
+
+    bam_batch(const bam_batch&) = delete;
+    bam_batch& operator=(const bam_batch&) = delete;
+
+    ~bam_batch() {
+        for (bam1_t* lread : slots) {
+            bam_destroy1(lread);
+        }
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    size_t capacity() const {
+        return slots.size();
+    }
+
+    bam1_t* get_read(size_t i) {
+        return slots[i];
+    }
+
+    // UMI of read i as a null terminated string.
+    const char* get_umi(size_t i) const {
+        return &umi[i * (umi_len + 1)];
+    }
+
+    // Finds the umi_XXXXXX field of a qname without compiling a regex per
+    // read. Agrees with the POSIX regex "^\S+?umi_(\w{6}).*$" used before:
+    // under leftmost-longest matching that picks the last "umi_" followed
+    // by umi_len word characters within the leading non-space part.
+    static const char* find_umi(const char* qname, size_t umi_len) {
+        size_t lspan = strcspn(qname, " \t\n\v\f\r");
+        size_t lfield = 4 + umi_len;
+        for (size_t lpos = lspan; lpos >= lfield; lpos--) {
+            const char* lstart = qname + lpos - lfield;
+            if (memcmp(lstart, "umi_", 4) != 0) {
+                continue;
+            }
+            const char* lumi = lstart + 4;
+            size_t k = 0;
+            while (k < umi_len && is_word_char(lumi[k])) {
+                k++;
+            }
+            if (k == umi_len) {
+                return lumi;
+            }
+        }
+        return NULL;
+    }
+
+    // Fills the key arrays of the first count reads.
+    void extract_keys() {
+        for (size_t i = 0; i < count; i++) {
+            const bam1_core_t& lcore = slots[i] -> core;
+            // Start is 1 based to agree with the sam text file.
+            start_pos[i] = lcore.pos + 1;
+            end_pos[i] = start_pos[i] + lcore.l_qseq - 1;
+            strand[i] = (lcore.flag & BAM_FREVERSE) ? '-' : '+';
+            mapq[i] = lcore.qual;
+            is_mapped[i] = !(lcore.flag & BAM_FUNMAP);
+            aln_len[i] = bam_cigar2rlen(lcore.n_cigar, bam_get_cigar(slots[i]));
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            char* lumi = &umi[i * (umi_len + 1)];
+            const char* lsrc = find_umi(bam_get_qname(slots[i]), umi_len);
+            if (!lsrc) {
+                umi_ok[i] = 0;
+                lumi[0] = 0;
+                continue;
+            }
+            memcpy(lumi, lsrc, umi_len);
+            lumi[umi_len] = 0;
+            umi_ok[i] = 1;
+        }
+    }
+
+    size_t umi_len;
+    size_t count = 0;
+    std::vector<bam1_t*> slots;
+
+    std::vector<unsigned long> start_pos;
+    std::vector<unsigned long> end_pos;
+    std::vector<char> strand;
+    std::vector<unsigned int> mapq;
+    std::vector<unsigned int> aln_len;
+    std::vector<char> is_mapped;
+    std::vector<char> umi_ok;
+    std::vector<char> umi;
+
+    private:
+
+    static bool is_word_char(char c) {
+        return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+            (c >= '0' && c <= '9') || c == '_';
+    }
+
+};
+
+#endif
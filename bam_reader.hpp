@@ -5,33 +5,102 @@
 #include <cmath>
 #include <regex>
 #include <htslib/sam.h>
-#include <regex.h>
 #include "bam_record.hpp"
+#include "read_filter.hpp"
+#include "bam_batch.hpp"
 
 class bam_reader {
     public:
 
     bam_reader() = default;
 
-    bam_reader(std::string& infile_str) {
-        const char* format = NULL;
-        if (has_suffix(infile_str, "sam")) {
-            format = "r";
-        } else if (has_suffix(infile_str, "bam")) {
-            format = "rb";
-        } else {
-            std::string lstr = "File with illegal suffix: " + infile_str + "\n";
-            throw std::runtime_error(lstr);
-        }
+    // infile_str may be "-" for stdin. The format is taken from
+    // format_str ("sam", "bam" or "cram") if given, otherwise from the
+    // suffix. ref_str is the fasta reference used to decode cram.
+    bam_reader(std::string& infile_str, const std::string& format_str = "",
+        const std::string& ref_str = "") {
+        const char* format = get_read_mode(infile_str, format_str);
 
         const char* infile_cstr = infile_str.c_str();
         if (!(fp = sam_open(infile_cstr, format))) {
             throw std::runtime_error("Error in sam_open");
         }
+        if (!ref_str.empty()) {
+            if (hts_set_fai_filename(fp, ref_str.c_str()) != 0) {
+                throw std::runtime_error("Could not load reference: " + ref_str);
+            }
+        }
 
         lhdr = sam_hdr_read(fp);
         lread = bam_init1();
+        this -> infile_str = infile_str;
+
+    }
+
+    // Size of the underlying hFILE buffer, so that the file is read in
+    // large sequential chunks.
+    void set_block_size(unsigned long block_size) {
+        if (hts_set_opt(fp, HTS_OPT_BLOCK_SIZE, (int) block_size) != 0) {
+            std::cout << "Could not set the block size to " << 
+                std::to_string(block_size) << "\n";
+        }
+    }
+
+    // Offset into the compressed file of the next read for bgzf input,
+    // -1 for other inputs.
+    long get_compressed_offset() {
+        if (fp -> format.compression != bgzf || fp -> is_cram) {
+            return -1;
+        }
+        return bgzf_tell(fp -> fp.bgzf) >> 16;
+    }
+
+    // Virtual offset of the next read for bgzf input, -1 for other inputs.
+    long get_virtual_offset() {
+        if (fp -> format.compression != bgzf || fp -> is_cram) {
+            return -1;
+        }
+        return bgzf_tell(fp -> fp.bgzf);
+    }
 
+    // Reads starting at or after the virtual offset end_offset are not
+    // returned; -1 reads to the end of the file. bgzf input only.
+    void set_end_offset(long end_offset) {
+        this -> end_offset = end_offset;
+    }
+
+    // Moves to a virtual offset taken from bam_writer::get_virtual_offset;
+    // bgzf input only.
+    void seek(long voffset) {
+        if (fp -> format.compression != bgzf || fp -> is_cram) {
+            throw std::runtime_error("Seek needs a bgzf compressed input: " +
+                infile_str);
+        }
+        if (bgzf_seek(fp -> fp.bgzf, voffset, SEEK_SET) < 0) {
+            throw std::runtime_error("Could not seek in: " + infile_str);
+        }
+    }
+
+    // Number of reads according to the index next to the file (.bai,
+    // .csi or .crai), -1 if there is none.
+    long get_indexed_count() {
+        if (infile_str == "-" || !(has_index_file(".bai") ||
+            has_index_file(".csi") || has_index_file(".crai"))) {
+            return -1;
+        }
+        hts_idx_t* lidx = sam_index_load(fp, infile_str.c_str());
+        if (!lidx) {
+            return -1;
+        }
+        uint64_t lcount = hts_idx_get_n_no_coor(lidx);
+        for (int tid = 0; tid < lhdr -> n_targets; tid++) {
+            uint64_t lmapped = 0, lunmapped = 0;
+            if (hts_idx_get_stat(lidx, tid, &lmapped, &lunmapped) == 0) {
+                lcount += lmapped + lunmapped;
+            }
+        }
+        hts_idx_destroy(lidx);
+        return lcount;
     }
 
     bam_hdr_t* get_sam_header() {
@@ -61,91 +130,154 @@ class bam_reader {
         return refname;
     }
 
-   char* regex_match_cstr(const char* regex_str, char* full_rec,
-        int match_len) {
-        regex_t regex;
-        int nmatch = 2;
-        regmatch_t pmatch[2];
+    const char* get_read_mode(const std::string& infile_str,
+        const std::string& format_str) {
+        std::string lformat = format_str;
+        if (lformat.empty()) {
+            if (infile_str == "-") {
+                // htslib detects the format of the stream by itself.
+                return "r";
+            } else if (has_suffix(infile_str, "sam")) {
+                lformat = "sam";
+            } else if (has_suffix(infile_str, "bam")) {
+                lformat = "bam";
+            } else if (has_suffix(infile_str, "cram")) {
+                lformat = "cram";
+            } else {
+                std::string lstr = "File with illegal suffix: " + infile_str + "\n";
+                throw std::runtime_error(lstr);
+            }
+        }
+        if (lformat == "sam") {
+            return "r";
+        } else if (lformat == "bam") {
+            return "rb";
+        } else if (lformat == "cram") {
+            return "rc";
+        } else {
+            std::string lstr = "Illegal input format: " + lformat + "\n";
+            throw std::runtime_error(lstr);
+        }
+    }
 
-        int reti = regcomp(&regex, regex_str, REG_EXTENDED);
-        if (reti) {
-            fprintf(stderr, "Could not compile regex\n");
-            return NULL;
-        } 
+    // Reads failing lfilter are skipped before they are decoded. The
+    // filter has to outlive the reader.
+    void set_filter(const read_filter* lfilter) {
+        filter = lfilter;
+    }
 
+    unsigned long get_filtered_count() {
+        return filtered_count;
+    }
 
-        reti = regexec(&regex, full_rec, 2, pmatch, 0);
-        if (!reti) {
-            char* result = new char[match_len + 1];
-            int len = pmatch[1].rm_eo - pmatch[1].rm_so;
-            memcpy(result, full_rec + pmatch[1].rm_so, len);
-            result[len] = 0;
-            regfree(&regex);
-            return result;
+    std::string read_record(bam_record& bam_rec) {
+        bam1_t* raw_read = read_raw();
+        if (raw_read) {
+            return decode_record(lhdr, raw_read, bam_rec);
         }
-        return NULL;
+        return std::string();
     }
- 
 
-    std::string read_record(bam_record& bam_rec) {
+    // Next alignment passing the filter, without decoding it; NULL at the
+    // end of the file. The alignment is overwritten by the next call.
+    bam1_t* read_raw() {
         int ret_val = -1;
         // Return value of sam_read1:
         // 0 if successful; otherwise negative
-        if ((ret_val = sam_read1(fp, lhdr, lread)) >= 0) {
-            // Get the other things
-            char* next_record = bam_format1(lhdr, lread);
-            uint16_t flag = (lread -> core).flag;
-            bool is_mapped = !(flag & BAM_FUNMAP);
-            // Process the read and return
-            // Get the query_name
-            char* qname_src = bam_get_qname(lread);
-            int qname_len = strlen(qname_src) + 1;
-            char* qname = new char[qname_len];
-            memcpy(qname, qname_src, qname_len);
-            // Get the ref_name
-
-            // Get umi_str
-            // Get start_pos
-            // Get umi string; extract the umi_XXXXXX part from the read
-            // Note the length of UMI is 6 base pair, which is indicated here
-            const char* regex_str = "^\\S+?umi_(\\w{6}).*$";
-            int match_len = 6;
-            char* umi_str = regex_match_cstr(regex_str, qname, match_len);
-            if (!umi_str) {
-                std::string err_str = "umi str not found, qname: " + std::string(qname);
-                throw std::runtime_error(err_str);
+        while (!at_end_offset() && (ret_val = sam_read1(fp, lhdr, lread)) >= 0) {
+            if (filter && !filter -> pass(lread)) {
+                filtered_count++;
+                continue;
             }
+            return lread;
+        }
+        return NULL;
+    }
 
-            // Get start_pos; we added 1 to keep it in agreement with respect 
-            // to positions in the sam text file.
-            unsigned long start_pos = (lread -> core).pos + 1;
+    // Fills batch with the next reads passing the filter and extracts their
+    // keys; returns the number of reads, 0 at the end of the file. The
+    // reads are overwritten by the next call.
+    size_t read_batch(bam_batch& batch) {
+        batch.count = 0;
+        while (batch.count < batch.capacity()) {
+            bam1_t* lslot = batch.get_read(batch.count);
+            if (at_end_offset() || sam_read1(fp, lhdr, lslot) < 0) {
+                break;
+            }
+            if (filter && !filter -> pass(lslot)) {
+                filtered_count++;
+                continue;
+            }
+            batch.count++;
+        }
+        batch.extract_keys();
+        return batch.count;
+    }
 
-            // Get end_pos
-            unsigned int q_len = (lread -> core).l_qseq;
-            unsigned long end_pos = start_pos + q_len -1;
+    // Extracts the umi_XXXXXX part of the qname (umi_len bases); the caller
+    // owns the returned string.
+    static char* get_umi_str(const char* qname, size_t umi_len = 6) {
+        size_t match_len = umi_len;
+        const char* umi_src = bam_batch::find_umi(qname, match_len);
+        if (!umi_src) {
+            std::string err_str = "umi str not found, qname: " + std::string(qname);
+            throw std::runtime_error(err_str);
+        }
+        char* umi_str = new char[match_len + 1];
+        memcpy(umi_str, umi_src, match_len);
+        umi_str[match_len] = 0;
+        return umi_str;
+    }
 
-            // Get strand 
-            char lstrand = '.';
-            if (bam_is_rev(lread)) {
-                lstrand = '-';
-            } else {
-                lstrand = '+';
-            }
-            
-            int reader_index = -1;
-            int ref_name_id = (lread -> core).tid;
-            std::string next_rec_str(next_record);
-            bam_record bam_rec_temp(is_mapped, ref_name_id, umi_str, lstrand,
-                start_pos, end_pos, qname, next_record, reader_index); 
-            bam_rec = bam_rec_temp;
-
-            delete[] umi_str;
-            free(next_record);
-            delete[] qname;
-             
-            return next_rec_str;
+    // Fills bam_rec from an alignment of a file with header lhdr and
+    // returns its SAM line.
+    static std::string decode_record(const bam_hdr_t* lhdr, const bam1_t* lread,
+        bam_record& bam_rec, size_t umi_len = 6) {
+        char* umi_str = get_umi_str(bam_get_qname(lread), umi_len);
+
+        // Get start_pos; we added 1 to keep it in agreement with respect 
+        // to positions in the sam text file.
+        unsigned long start_pos = (lread -> core).pos + 1;
+        unsigned long end_pos = start_pos + (lread -> core).l_qseq - 1;
+        char lstrand = bam_is_rev(lread) ? '-' : '+';
+        bool is_mapped = !((lread -> core).flag & BAM_FUNMAP);
+
+        make_record(lhdr, lread, is_mapped, umi_str, lstrand, start_pos,
+            end_pos, bam_rec);
+        bam_rec.mapq = (lread -> core).qual;
+        bam_rec.aln_len = bam_cigar2rlen((lread -> core).n_cigar,
+            bam_get_cigar(lread));
+        delete[] umi_str;
+        return std::string(bam_rec.full_rec);
+    }
+
+    // Fills bam_rec from read i of a batch, using the keys extracted by
+    // read_batch.
+    static void decode_batch_record(const bam_hdr_t* lhdr, bam_batch& batch,
+        size_t i, bam_record& bam_rec) {
+        const bam1_t* lread = batch.get_read(i);
+        if (!batch.umi_ok[i]) {
+            std::string err_str = "umi str not found, qname: " +
+                std::string(bam_get_qname(lread));
+            throw std::runtime_error(err_str);
         }
-        return std::string();
+        make_record(lhdr, lread, batch.is_mapped[i], (char*) batch.get_umi(i),
+            batch.strand[i], batch.start_pos[i], batch.end_pos[i], bam_rec);
+        bam_rec.mapq = batch.mapq[i];
+        bam_rec.aln_len = batch.aln_len[i];
+    }
+
+    bool at_end_offset() {
+        return end_offset >= 0 && get_virtual_offset() >= end_offset;
+    }
+
+    bool has_index_file(const std::string& idx_suffix) {
+        FILE* lfile = fopen((infile_str + idx_suffix).c_str(), "rb");
+        if (lfile) {
+            fclose(lfile);
+            return true;
+        }
+        return false;
     }
 
     bool has_suffix(const std::string &str, const std::string &suf)
@@ -155,8 +287,26 @@ class bam_reader {
     }
 
 
+    // Formats the SAM line of lread and moves the record into bam_rec; the
+    // qname is copied straight out of the alignment.
+    static void make_record(const bam_hdr_t* lhdr, const bam1_t* lread,
+        bool is_mapped, char* umi_str, char lstrand, unsigned long start_pos,
+        unsigned long end_pos, bam_record& bam_rec) {
+        char* next_record = bam_format1(lhdr, lread);
+        if (!next_record) {
+            throw std::runtime_error("Could not format read: " +
+                std::string(bam_get_qname(lread)));
+        }
+        int reader_index = -1;
+        int ref_name_id = (lread -> core).tid;
+        bam_record bam_rec_temp(is_mapped, ref_name_id, umi_str, lstrand,
+            start_pos, end_pos, bam_get_qname(lread), next_record, reader_index);
+        bam_rec = std::move(bam_rec_temp);
+        free(next_record);
+    }
+
     // Copied from bam.c of samtools
-    char* bam_format1(const bam_hdr_t *header, const bam1_t *b) {
+    static char* bam_format1(const bam_hdr_t *header, const bam1_t *b) {
         kstring_t str;
         str.l = str.m = 0; str.s = NULL;
         if (sam_format1(header, b, &str) < 0) {
@@ -178,6 +328,9 @@ class bam_reader {
     htsFile *fp = NULL;
     bam_hdr_t *lhdr = NULL;
     bam1_t* lread = NULL;
+    const read_filter* filter = NULL;
+    unsigned long filtered_count = 0;
+    long end_offset = -1;
 
 
 };
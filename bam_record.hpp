@@ -2,6 +2,7 @@
 #define _BAM_RECORD_HPP
 
 #include <iostream>
+#include <cstring>
 
 class bam_record {
 
@@ -15,10 +16,14 @@ class bam_record {
     char* qname;
     char* full_rec;
     int reader_index = -1;
+    unsigned int mapq = 0;
+    // Length of the alignment on the reference
+    unsigned int aln_len = 0;
 
-    unsigned int get_size() {
+    unsigned int get_size() const {
         unsigned int lsize = sizeof(bool) + sizeof(char) + 
             2 * sizeof(unsigned long) + 2 * sizeof (int) + 
+            2 * sizeof(unsigned int) + 
             strlen(umi) + strlen(qname) + strlen(full_rec) + 3;
         return lsize;
     }
@@ -78,6 +83,8 @@ class bam_record {
         start_pos = that.start_pos;
         end_pos = that.end_pos;
         reader_index = that.reader_index;
+        mapq = that.mapq;
+        aln_len = that.aln_len;
  
         size_t umi_len  = strlen(that.umi) + 1;
         umi = new char[umi_len];
@@ -106,6 +113,8 @@ class bam_record {
         std::swap(a.start_pos, b.start_pos);
         std::swap(a.end_pos, b.end_pos);
         std::swap(a.reader_index, b.reader_index);
+        std::swap(a.mapq, b.mapq);
+        std::swap(a.aln_len, b.aln_len);
         std::swap(a.qname, b.qname);
         std::swap(a.umi, b.umi);
         std::swap(a.full_rec, b.full_rec);
@@ -121,6 +130,8 @@ class bam_record {
         start_pos = that.start_pos;
         end_pos = that.end_pos;
         reader_index = that.reader_index;
+        mapq = that.mapq;
+        aln_len = that.aln_len;
         umi = that.umi;
         that.umi = nullptr;
         qname = that.qname;
@@ -132,6 +143,13 @@ class bam_record {
     // Move assignment operator
     bam_record& operator=(bam_record&& that)   
     {
+        if (this == &that) {
+            return *this;
+        }
+        // Release what this record owned so far
+        delete[] umi;
+        delete[] qname;
+        delete[] full_rec;
         // First copy the primitive types
         is_mapped = that.is_mapped;
         ref_name_id = that.ref_name_id;
@@ -139,6 +157,8 @@ class bam_record {
         start_pos = that.start_pos;
         end_pos = that.end_pos;
         reader_index = that.reader_index;
+        mapq = that.mapq;
+        aln_len = that.aln_len;
         umi = that.umi;
         that.umi = nullptr;
         qname = that.qname;
@@ -150,13 +170,28 @@ class bam_record {
 
 };
 
-struct compare_bam_less {
+// Compares two UMIs like strcmp. With UMI_LEN > 0 both UMIs are known to
+// have that many bases and the comparison is a memcmp of constant length,
+// which the compiler inlines; 0 is for UMIs of any length.
+template <size_t UMI_LEN>
+inline int compare_umi(const char* a, const char* b) {
+    return memcmp(a, b, UMI_LEN);
+}
+
+template <>
+inline int compare_umi<0>(const char* a, const char* b) {
+    return strcmp(a, b);
+}
 
-    bool operator()(const bam_record& a, const bam_record& b)   {
+// compare_bam_less for UMIs of UMI_LEN bases, see compare_umi.
+template <size_t UMI_LEN>
+struct compare_bam_less_fixed {
+
+    bool operator()(const bam_record& a, const bam_record& b) const {
         if (a.ref_name_id < b.ref_name_id) {
             return true;
         } else if (a.ref_name_id == b.ref_name_id) {
-            int umi_c = strcmp(a.umi, b.umi);
+            int umi_c = compare_umi<UMI_LEN>(a.umi, b.umi);
             if (umi_c < 0) {
                 return true;
             } else if (umi_c == 0) {
@@ -178,9 +213,10 @@ struct compare_bam_less {
     }
 };
 
-struct compare_bam_greater {
+template <size_t UMI_LEN>
+struct compare_bam_greater_fixed {
 
-    bool operator()(const bam_record& a, const bam_record& b)   {
+    bool operator()(const bam_record& a, const bam_record& b) const {
         if (a.ref_name_id > b.ref_name_id) {
             return true;
         } else if (a.ref_name_id == b.ref_name_id) {
@@ -188,7 +224,7 @@ struct compare_bam_greater {
             // comparison, so the string comparison between
             // a.qname and b.qname may not be required
             // except extreme cases.
-            int umi_c = strcmp(a.umi, b.umi);
+            int umi_c = compare_umi<UMI_LEN>(a.umi, b.umi);
             if (umi_c > 0) {
                 return true;
             } else if (umi_c == 0) {
@@ -210,4 +246,11 @@ struct compare_bam_greater {
     }
 };
 
+// Order of the sorted runs: ref, UMI, strand, start and qname.
+struct compare_bam_less : compare_bam_less_fixed<0> {
+};
+
+struct compare_bam_greater : compare_bam_greater_fixed<0> {
+};
+
 #endif
@@ -1,6 +1,10 @@
 #ifndef _BAM_WRITER_HPP
 #define _BAM_WRITER_HPP
 
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <cmath>
 #include <htslib/sam.h>
 
 
@@ -8,24 +12,25 @@ class bam_writer {
 
     public:
 
-    bam_writer(std::string& outfile_str, bam_hdr_t* lhdr1) {
-        const char* format = NULL;
-        if (has_suffix(outfile_str, "sam")) {
-            format = "w";
-        } else if (has_suffix(outfile_str, "bam")) {
-            format = "wb";
-        } else {
-            std::string lstr = "File with illegal suffix: " + outfile_str + "\n";
-            throw std::runtime_error(lstr);
-        }
+    // outfile_str may be "-" for stdout. The format is taken from
+    // format_str ("sam", "bam" or "cram") if given, otherwise from the
+    // suffix. ref_str is the fasta reference used to encode cram.
+    bam_writer(std::string& outfile_str, bam_hdr_t* lhdr1,
+        const std::string& format_str = "", const std::string& ref_str = "") {
+        const char* format = get_write_mode(outfile_str, format_str);
 
         const char* outfile_cstr = outfile_str.c_str();
-        printf("%s\t%s\n", outfile_cstr, format);
+        std::cout << outfile_str << "\t" << format << "\n";
         if (!(fp = sam_open(outfile_cstr, format))) {
             std::cout << "Error in opening sam file" << "\n";
         } else {
             std::cout << "Successfully created the outfile: " << outfile_str << "\n";
         }
+        if (fp && !ref_str.empty()) {
+            if (hts_set_fai_filename(fp, ref_str.c_str()) != 0) {
+                throw std::runtime_error("Could not load reference: " + ref_str);
+            }
+        }
         /*
         if(!(lhdr = bam_hdr_init())) {
             std::cout << "Error in bam header init" << "\n";
@@ -46,6 +51,35 @@ class bam_writer {
 
     }
 
+    const char* get_write_mode(const std::string& outfile_str,
+        const std::string& format_str) {
+        std::string lformat = format_str;
+        if (lformat.empty()) {
+            if (outfile_str == "-") {
+                lformat = "bam";
+            } else if (has_suffix(outfile_str, "sam")) {
+                lformat = "sam";
+            } else if (has_suffix(outfile_str, "bam")) {
+                lformat = "bam";
+            } else if (has_suffix(outfile_str, "cram")) {
+                lformat = "cram";
+            } else {
+                std::string lstr = "File with illegal suffix: " + outfile_str + "\n";
+                throw std::runtime_error(lstr);
+            }
+        }
+        if (lformat == "sam") {
+            return "w";
+        } else if (lformat == "bam") {
+            return "wb";
+        } else if (lformat == "cram") {
+            return "wc";
+        } else {
+            std::string lstr = "Illegal output format: " + lformat + "\n";
+            throw std::runtime_error(lstr);
+        }
+    }
+
     size_t get_m(size_t var) {
         size_t lvar = (size_t)exp2(ceil(log2(var)));
         return lvar;
@@ -68,6 +102,54 @@ class bam_writer {
 
     }
 
+    // Writes an alignment that uses the same header, without going
+    // through its SAM text.
+    void write_bam(const bam1_t* lread) {
+        if (sam_write1(fp, lhdr, lread) < 0) {
+            std::cout << "Problem with sam_write1" << "\n";
+        }
+    }
+
+    // Virtual offset (see bgzf_tell) at which the next record will start,
+    // usable as a seek target into a bam output; -1 for sam and cram.
+    long get_virtual_offset() {
+        if (!fp || fp -> format.compression != bgzf || fp -> is_cram) {
+            return -1;
+        }
+        return bgzf_tell(fp -> fp.bgzf);
+    }
+
+    // Builds an index while the records are written; has to be called
+    // right after the header, for a coordinate sorted bam. The index is
+    // a .bai, or a .csi if a reference is too long for a .bai. Returns
+    // the index path.
+    std::string init_index(const std::string& outfile_str) {
+        if (!fp || fp -> format.compression != bgzf || fp -> is_cram) {
+            throw std::runtime_error("Only a bam file can be indexed: " +
+                outfile_str);
+        }
+        int min_shift = 0;
+        std::string idx_str = outfile_str + ".bai";
+        for (int tid = 0; tid < lhdr -> n_targets; tid++) {
+            if (lhdr -> target_len[tid] > (1u << 29)) {
+                min_shift = 14;
+                idx_str = outfile_str + ".csi";
+                break;
+            }
+        }
+        if (sam_idx_init(fp, lhdr, min_shift, idx_str.c_str()) < 0) {
+            throw std::runtime_error("Could not start the index: " + idx_str);
+        }
+        return idx_str;
+    }
+
+    // Writes the index started by init_index.
+    void save_index() {
+        if (sam_idx_save(fp) < 0) {
+            throw std::runtime_error("Could not save the index");
+        }
+    }
+
 bool has_suffix(const std::string &str, const std::string &suf)
     {
         return str.size() >= suf.size() &&
@@ -2,20 +2,21 @@
 #define _BED_WRITER_HPP
 
 #include <htslib/sam.h>
-#include <fstream>
+#include <string>
+#include "text_sink.hpp"
 
 
 class bed_writer {
 
     public:
 
-    bed_writer(std::string& outfile_str): 
+    bed_writer(std::string& outfile_str, bool compress = false):
         outfile_str(outfile_str),
-        outfile(outfile_str) {
+        outfile(outfile_str, compress) {
     }
 
     void write_record_str(const std::string& record) {
-        outfile << record << "\n";
+        outfile.put(record).put('\n');
     }
 
     void write_record_items (
@@ -27,20 +28,23 @@ class bed_writer {
         const int score,
         const std::string& strand) {
 
-        std::string out_str = chrom + "\t" + 
-            std::to_string(chromStart) + "\t" +
-            std::to_string(chromEnd) + "\t" +
-            name + "\t" +
-            std::to_string(score) + "\t" +
-            strand;
+        outfile.put(chrom).put('\t').
+            put_uint(chromStart).put('\t').
+            put_uint(chromEnd).put('\t').
+            put(name).put('\t').
+            put_int(score).put('\t').
+            put(strand).put('\n');
+    }
 
-        outfile << out_str << "\n";
+    // The sink itself, for callers that format the columns in place.
+    text_sink& get_sink() {
+        return outfile;
     }
-        
+
     private:
 
     std::string outfile_str;
-    std::ofstream outfile;    
+    text_sink outfile;
 
 };
 
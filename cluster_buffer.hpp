@@ -0,0 +1,144 @@
+#ifndef _CLUSTER_BUFFER_HPP
+#define _CLUSTER_BUFFER_HPP
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fstream>
+#include "bam_record.hpp"
+
+// Holds the reads of the cluster currently being built in merge_files.
+// Reads are kept in memory until mem_lim bytes are used; the rest of the
+// cluster is spilled as SAM lines to a temporary file. The first and the
+// last read are always available in memory, and every read can still be
+// visited in order, so a cluster of any size can be collapsed.
+class cluster_buffer {
+
+    public:
+
+    cluster_buffer(const std::string& spill_str, unsigned long mem_lim):
+        spill_str(spill_str),
+        mem_lim(mem_lim) {
+    }
+
+    cluster_buffer(const cluster_buffer&) = delete;
+    cluster_buffer& operator=(const cluster_buffer&) = delete;
+
+    void push_back(const bam_record& lrec) {
+        unsigned long lsize = lrec.get_size();
+        if (mem_vec.empty() ||
+            (spill_count == 0 && mem_used + lsize <= mem_lim)) {
+            mem_vec.push_back(lrec);
+            mem_used += lsize;
+            return;
+        }
+
+        if (!spill_stream.is_open()) {
+            std::cout << "Spilling cluster of more than " << mem_vec.size() <<
+                " reads to: " << spill_str << "\n";
+            spill_stream.open(spill_str, std::ios::in | std::ios::out |
+                std::ios::trunc);
+            if (!spill_stream.is_open()) {
+                throw std::runtime_error("Could not open spill file: " +
+                    spill_str);
+            }
+            spill_created = true;
+        }
+        spill_stream << lrec.full_rec << "\n";
+        spill_count++;
+        last_spilled = lrec;
+    }
+
+    size_t size() const {
+        return mem_vec.size() + spill_count;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    const bam_record& front() const {
+        return mem_vec.front();
+    }
+
+    const bam_record& back() const {
+        if (spill_count > 0) {
+            return last_spilled;
+        }
+        return mem_vec.back();
+    }
+
+    // SAM line of the read at position pos of the cluster.
+    std::string get_full_rec(size_t pos) {
+        if (pos < mem_vec.size()) {
+            return std::string(mem_vec[pos].full_rec);
+        }
+        size_t spill_pos = pos - mem_vec.size();
+        std::string line;
+        rewind_spill();
+        for (size_t i = 0; i <= spill_pos; i++) {
+            if (!std::getline(spill_stream, line)) {
+                throw std::runtime_error("Short read from spill file: " +
+                    spill_str);
+            }
+        }
+        return line;
+    }
+
+    // Calls func with the SAM line of every read of the cluster, in order.
+    template <typename Func>
+    void for_each_full_rec(Func func) {
+        for (const bam_record& lrec : mem_vec) {
+            func(lrec.full_rec);
+        }
+        if (spill_count > 0) {
+            std::string line;
+            rewind_spill();
+            for (size_t i = 0; i < spill_count; i++) {
+                if (!std::getline(spill_stream, line)) {
+                    throw std::runtime_error("Short read from spill file: " +
+                        spill_str);
+                }
+                func(line.c_str());
+            }
+        }
+    }
+
+    void clear() {
+        mem_vec.clear();
+        mem_used = 0;
+        if (spill_stream.is_open()) {
+            spill_stream.close();
+        }
+        spill_count = 0;
+    }
+
+    ~cluster_buffer() {
+        if (spill_stream.is_open()) {
+            spill_stream.close();
+        }
+        if (spill_created) {
+            std::remove(spill_str.c_str());
+        }
+    }
+
+    private:
+
+    void rewind_spill() {
+        spill_stream.flush();
+        spill_stream.clear();
+        spill_stream.seekg(0);
+    }
+
+    std::string spill_str;
+    unsigned long mem_lim;
+    unsigned long mem_used = 0;
+    std::vector<bam_record> mem_vec;
+    std::fstream spill_stream;
+    size_t spill_count = 0;
+    bool spill_created = false;
+    bam_record last_spilled;
+
+};
+
+#endif
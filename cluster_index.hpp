@@ -0,0 +1,399 @@
+#ifndef _CLUSTER_INDEX_HPP
+#define _CLUSTER_INDEX_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <functional>
+#include <unordered_map>
+#include <iostream>
+#include <stdexcept>
+#include <experimental/filesystem>
+#include <htslib/sam.h>
+#include "bam_reader.hpp"
+#include "bam_record.hpp"
+#include "text_sink.hpp"
+
+// Sidecar index of the UMI clusters, <prefix>_clusters.tsv. A few header
+// lines name the outputs the offsets point into and the order of the
+// lines, then come the column names and one line per cluster:
+//
+//   ##sorted  <path of the sorted output, or - if none was written>
+//   ##u       <path of the _u output, or - for stdout>
+//   ##order   sorted | unsorted
+//   #ref  umi  strand  start  end  reads  sorted_voffset  u_voffset
+//
+// The paths are relative to the directory of the index when they are in
+// it. sorted_voffset is the bgzf virtual offset of the first read of the
+// cluster in the sorted output and u_voffset that of its representative
+// in the _u output; -1 where the output is not bam (or, for the sorted
+// offset, not written at all). The reads of a cluster are the `reads`
+// records starting at sorted_voffset. The lines are in the sorted order
+// of the collapse (reference, UMI, strand, start) unless the clusters
+// came from the coordinate stream.
+struct cluster_entry {
+    std::string ref_name;
+    std::string umi;
+    char strand = '.';
+    unsigned long start_pos = 0;
+    unsigned long end_pos = 0;
+    unsigned long read_count = 0;
+    long sorted_offset = -1;
+    long u_offset = -1;
+};
+
+class cluster_index_writer {
+
+    public:
+
+    // sorted_str is empty and u_str is "-" for outputs that have no file.
+    cluster_index_writer(const std::string& index_str,
+            const std::string& sorted_str, const std::string& u_str,
+            bool sorted_order):
+        index_sink(index_str) {
+        index_sink.put("##sorted\t").put(get_stored_path(index_str, sorted_str)).
+            put("\n##u\t").put(get_stored_path(index_str, u_str)).
+            put("\n##order\t").put(sorted_order ? "sorted" : "unsorted").
+            put("\n#ref\tumi\tstrand\tstart\tend\treads\t"
+            "sorted_voffset\tu_voffset\n");
+    }
+
+    void add(bam_hdr_t* lhdr, const bam_record& first_rec,
+            const bam_record& last_rec, unsigned long read_count,
+            long sorted_offset, long u_offset) {
+        index_sink.put(sam_hdr_tid2name(lhdr, first_rec.ref_name_id)).put('\t').
+            put(first_rec.umi).put('\t').
+            put(first_rec.strand).put('\t').
+            put_uint(first_rec.start_pos).put('\t').
+            put_uint(last_rec.end_pos).put('\t').
+            put_uint(read_count).put('\t').
+            put_int(sorted_offset).put('\t').
+            put_int(u_offset).put('\n');
+    }
+
+    private:
+
+    // Path of file_str relative to the directory of the index if it is in
+    // it, otherwise absolute.
+    static std::string get_stored_path(const std::string& index_str,
+            const std::string& file_str) {
+        if (file_str.empty() || file_str == "-") {
+            return "-";
+        }
+        std::string ldir_str = std::experimental::filesystem::absolute(index_str).parent_path().string() + "/";
+        std::string lpath_str = std::experimental::filesystem::absolute(file_str).string();
+        if (lpath_str.compare(0, ldir_str.size(), ldir_str) == 0) {
+            return lpath_str.substr(ldir_str.size());
+        }
+        return lpath_str;
+    }
+
+    text_sink index_sink;
+
+};
+
+// Looks clusters up in the index file without loading it: a sorted index
+// is searched by bisection over its bytes, given the order of the
+// references (set_ref_order); otherwise the lines are scanned.
+class cluster_index {
+
+    public:
+
+    cluster_index(const std::string& index_str):
+        index_str(index_str),
+        index_reader(index_str) {
+        if (!index_reader.is_open()) {
+            throw std::runtime_error("Could not open: " + index_str);
+        }
+        std::string ldir_str = std::experimental::filesystem::path(index_str).parent_path().string();
+        std::string line;
+        data_start = index_reader.tellg();
+        while (std::getline(index_reader, line) && line[0] == '#') {
+            std::istringstream lstream(line);
+            std::string lkey, lvalue;
+            lstream >> lkey >> lvalue;
+            if (lkey == "##sorted") {
+                sorted_str = get_full_path(ldir_str, lvalue);
+            } else if (lkey == "##u") {
+                u_str = get_full_path(ldir_str, lvalue);
+            } else if (lkey == "##order") {
+                sorted_order = lvalue == "sorted";
+            }
+            has_header = has_header || line.compare(0, 2, "##") == 0;
+            data_start = index_reader.tellg();
+        }
+        index_reader.clear();
+        index_reader.seekg(0, std::ios::end);
+        data_end = index_reader.tellg();
+    }
+
+    // False for an index of an older run, which names neither its outputs
+    // nor its order.
+    bool has_paths() const {
+        return has_header;
+    }
+
+    // Paths of the sorted and the _u output; empty if there is no file.
+    const std::string& get_sorted_path() const {
+        return sorted_str;
+    }
+
+    const std::string& get_u_path() const {
+        return u_str;
+    }
+
+    // Order of the references in the sorted order, from the header of the
+    // outputs; enables the bisection of a sorted index.
+    void set_ref_order(const bam_hdr_t* lhdr) {
+        ref_ids.clear();
+        for (int tid = 0; tid < lhdr -> n_targets; tid++) {
+            ref_ids[lhdr -> target_name[tid]] = tid;
+        }
+    }
+
+    // All clusters of one ref/UMI/strand, ordered by start.
+    std::vector<cluster_entry> find(const std::string& ref_name,
+            const std::string& umi, char strand) {
+        std::vector<cluster_entry> res;
+        cluster_entry ltarget;
+        ltarget.ref_name = ref_name;
+        ltarget.umi = umi;
+        ltarget.strand = strand;
+        bool lbisect = sorted_order && ref_ids.count(ref_name) > 0;
+        long lstart = lbisect ? find_start(ltarget) : data_start;
+        index_reader.clear();
+        index_reader.seekg(lstart);
+        std::string line;
+        while (std::getline(index_reader, line)) {
+            cluster_entry lentry = parse_line(line);
+            int lcmp = compare_key(lentry, ltarget);
+            if (lcmp == 0) {
+                res.push_back(lentry);
+            } else if (lbisect && lcmp > 0) {
+                break;
+            }
+        }
+        return res;
+    }
+
+    // Passes the reads of the cluster in the sorted bam to func.
+    static void read_sorted(bam_reader& reader, const cluster_entry& lentry,
+            std::function<void(const bam1_t*)> func) {
+        if (lentry.sorted_offset < 0) {
+            throw std::runtime_error("No sorted bam offset for the cluster.");
+        }
+        reader.seek(lentry.sorted_offset);
+        for (unsigned long j = 0; j < lentry.read_count; j++) {
+            const bam1_t* lread = reader.read_raw();
+            if (!lread) {
+                throw std::runtime_error("Sorted bam ends inside a cluster.");
+            }
+            func(lread);
+        }
+    }
+
+    // Passes the representative read of the cluster in _u.bam to func.
+    static void read_representative(bam_reader& reader,
+            const cluster_entry& lentry, std::function<void(const bam1_t*)> func) {
+        if (lentry.u_offset < 0) {
+            throw std::runtime_error("No _u bam offset for the cluster.");
+        }
+        reader.seek(lentry.u_offset);
+        const bam1_t* lread = reader.read_raw();
+        if (!lread) {
+            throw std::runtime_error("Could not read the representative.");
+        }
+        func(lread);
+    }
+
+    private:
+
+    // Bisection over the bytes of the lines for the start of a line that
+    // no line with the key of ltarget comes before; the last few kb are
+    // left to the scan of find.
+    long find_start(const cluster_entry& ltarget) {
+        const long scan_len = 1 << 14;
+        long lo = data_start;
+        long hi = data_end;
+        std::string line;
+        while (hi - lo > scan_len) {
+            long mid = lo + (hi - lo) / 2;
+            index_reader.clear();
+            index_reader.seekg(mid);
+            // The rest of the line around mid
+            std::getline(index_reader, line);
+            long lnext = index_reader.tellg();
+            if (!std::getline(index_reader, line)) {
+                hi = mid;
+            } else if (compare_key(parse_line(line), ltarget) < 0) {
+                lo = lnext;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    // Compares reference, UMI and strand in the sorted order.
+    int compare_key(const cluster_entry& a, const cluster_entry& b) const {
+        if (a.ref_name != b.ref_name) {
+            auto a_it = ref_ids.find(a.ref_name);
+            auto b_it = ref_ids.find(b.ref_name);
+            if (a_it == ref_ids.end() || b_it == ref_ids.end()) {
+                return 1;
+            }
+            return a_it -> second < b_it -> second ? -1 : 1;
+        }
+        int umi_c = a.umi.compare(b.umi);
+        if (umi_c != 0) {
+            return umi_c;
+        }
+        return a.strand < b.strand ? -1 : (a.strand > b.strand ? 1 : 0);
+    }
+
+    cluster_entry parse_line(const std::string& line) const {
+        std::istringstream lstream(line);
+        cluster_entry lentry;
+        if (!(lstream >> lentry.ref_name >> lentry.umi >> lentry.strand >>
+            lentry.start_pos >> lentry.end_pos >> lentry.read_count >>
+            lentry.sorted_offset >> lentry.u_offset)) {
+            throw std::runtime_error("Malformed line in " + index_str +
+                ": " + line);
+        }
+        return lentry;
+    }
+
+    static std::string get_full_path(const std::string& ldir_str,
+            const std::string& path_str) {
+        if (path_str == "-") {
+            return "";
+        }
+        if (std::experimental::filesystem::path(path_str).is_absolute() || ldir_str.empty()) {
+            return path_str;
+        }
+        return ldir_str + "/" + path_str;
+    }
+
+    std::string index_str;
+    std::ifstream index_reader;
+    long data_start = 0;
+    long data_end = 0;
+    bool has_header = false;
+    bool sorted_order = false;
+    std::string sorted_str;
+    std::string u_str;
+    std::unordered_map<std::string, int> ref_ids;
+
+};
+
+// Prints the reads of the clusters of one ref/UMI/strand, found through
+// the index of a run in <outdir> with <prefix>.
+class cluster_lookup {
+
+    public:
+
+    cluster_lookup(const std::string& outdir_str, const std::string& prefix_str,
+            std::ostream& out_stream):
+        out_stream(out_stream),
+        index(outdir_str + "/" + prefix_str + "_clusters.tsv") {
+        if (index.has_paths()) {
+            sorted_str = index.get_sorted_path();
+            u_str = index.get_u_path();
+        } else {
+            sorted_str = outdir_str + "/logdir/" + prefix_str + "_sorted.bam";
+            u_str = outdir_str + "/" + prefix_str + "_u.bam";
+        }
+    }
+
+    // cluster_str is <ref>:<umi>:<strand>; the reference name may itself
+    // contain ':'.
+    void run(const std::string& cluster_str) {
+        size_t strand_pos = cluster_str.rfind(':');
+        size_t umi_pos = strand_pos == std::string::npos || strand_pos == 0 ?
+            std::string::npos : cluster_str.rfind(':', strand_pos - 1);
+        if (umi_pos == std::string::npos ||
+            strand_pos + 2 != cluster_str.size()) {
+            throw std::runtime_error("Cluster has to be <ref>:<umi>:<strand>: " +
+                cluster_str);
+        }
+        std::string ref_name = cluster_str.substr(0, umi_pos);
+        std::string umi = cluster_str.substr(umi_pos + 1, strand_pos - umi_pos - 1);
+        char strand = cluster_str[strand_pos + 1];
+
+        // Either output has the order of the references for the bisection;
+        // without one the index is scanned.
+        std::unique_ptr<bam_reader> u_reader;
+        std::unique_ptr<bam_reader> sorted_reader;
+        if (index.has_paths()) {
+            if (!sorted_str.empty() &&
+                std::experimental::filesystem::exists(sorted_str)) {
+                sorted_reader.reset(new bam_reader(sorted_str));
+                index.set_ref_order(sorted_reader -> get_sam_header());
+            } else if (!u_str.empty() &&
+                std::experimental::filesystem::exists(u_str)) {
+                u_reader.reset(new bam_reader(u_str));
+                index.set_ref_order(u_reader -> get_sam_header());
+            }
+        }
+
+        std::vector<cluster_entry> lentries = index.find(ref_name, umi, strand);
+        std::cout << "Found " << lentries.size() << " clusters\n";
+
+        // Opened on the first entry with an offset into them; runs with a
+        // cram or stdout _u output index no _u offsets.
+        for (const cluster_entry& lentry : lentries) {
+            if (!u_reader && lentry.u_offset >= 0) {
+                u_reader.reset(new bam_reader(u_str));
+            }
+            if (!sorted_reader && lentry.sorted_offset >= 0) {
+                sorted_reader.reset(new bam_reader(sorted_str));
+            }
+            out_stream << "# cluster " << lentry.ref_name << " " <<
+                lentry.umi << " " << lentry.strand << " " <<
+                lentry.start_pos << " " << lentry.end_pos << " reads: " <<
+                lentry.read_count << "\n";
+            // A coordinate sorted _u.bam (--sort_u) has no offsets.
+            if (lentry.u_offset < 0) {
+                out_stream << "# representative not indexed\n";
+            } else {
+                out_stream << "# representative\n";
+                cluster_index::read_representative(*u_reader, lentry,
+                    [this, &u_reader](const bam1_t* lread) {
+                        print_read(u_reader -> get_sam_header(), lread);
+                    });
+            }
+            // Runs without a sorted output (--stream, --from_sorted) only
+            // index the representatives.
+            if (lentry.sorted_offset < 0) {
+                out_stream << "# reads not indexed\n";
+                continue;
+            }
+            out_stream << "# reads\n";
+            cluster_index::read_sorted(*sorted_reader, lentry,
+                [this, &sorted_reader](const bam1_t* lread) {
+                    print_read(sorted_reader -> get_sam_header(), lread);
+                });
+        }
+    }
+
+    private:
+
+    void print_read(const bam_hdr_t* lhdr, const bam1_t* lread) {
+        char* lrec_str = bam_reader::bam_format1(lhdr, lread);
+        if (!lrec_str) {
+            throw std::runtime_error("Could not format read.");
+        }
+        out_stream << lrec_str << "\n";
+        free(lrec_str);
+    }
+
+    std::ostream& out_stream;
+    cluster_index index;
+    std::string sorted_str;
+    std::string u_str;
+
+};
+
+#endif
@@ -0,0 +1,192 @@
+#ifndef _COLLAPSE_POLICY_HPP
+#define _COLLAPSE_POLICY_HPP
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+#include <htslib/sam.h>
+
+enum collapse_mode {FEATURE_COLLAPSE, COORDINATE_COLLAPSE};
+
+// How the clusters of one reference are cut: feature mode keeps all reads
+// of a ref/UMI/strand in one cluster, coordinate mode also breaks where
+// consecutive reads start more than brake_gap apart.
+struct ref_collapse {
+    collapse_mode mode = COORDINATE_COLLAPSE;
+    int brake_gap = 500;
+    // Gap given by a rule, rather than the default gap
+    bool fixed_gap = false;
+};
+
+// Collapse mode and gap per reference, so that host and pathogen
+// references of a dual RNA-seq library are collapsed in one pass. The
+// default comes from -c and the gap; rules_str overrides it for some
+// references with a comma separated list of
+//
+//   <name>=<mode>[:<gap>]    e.g.  NC_003197*=coordinate:500,chr*=feature
+//
+// where a name ending with '*' is a prefix. An exact name wins over a
+// prefix and a longer prefix over a shorter one. resolve() turns the rules
+// into a table by reference id once, so the collapse looks a read's mode
+// up by index.
+class collapse_policy {
+
+    public:
+
+    collapse_policy(const std::string& coll_str = "coordinate",
+            int brake_gap = 500, const std::string& rules_str = "") {
+        default_ref.mode = parse_mode(coll_str);
+        default_ref.brake_gap = brake_gap;
+        parse_rules(rules_str);
+    }
+
+    static collapse_mode parse_mode(const std::string& coll_str) {
+        if (coll_str == "feature") {
+            return FEATURE_COLLAPSE;
+        } else if (coll_str == "coordinate") {
+            return COORDINATE_COLLAPSE;
+        } else {
+            std::string throw_msg = "Illegal umi brake option: " + coll_str;
+            throw std::runtime_error(throw_msg);
+        }
+    }
+
+    // Builds the table of the references of lhdr.
+    void resolve(const bam_hdr_t* lhdr) {
+        ref_table.assign(lhdr -> n_targets, default_ref);
+        for (int tid = 0; tid < lhdr -> n_targets; tid++) {
+            std::string ref_name = lhdr -> target_name[tid];
+            size_t best_len = 0;
+            bool exact = false;
+            for (const rule& lrule : rules) {
+                if (!lrule.is_prefix) {
+                    if (lrule.name == ref_name) {
+                        ref_table[tid] = lrule.ref;
+                        exact = true;
+                    }
+                } else if (!exact && lrule.name.size() >= best_len &&
+                    ref_name.compare(0, lrule.name.size(), lrule.name) == 0) {
+                    ref_table[tid] = lrule.ref;
+                    best_len = lrule.name.size();
+                }
+            }
+        }
+    }
+
+    const ref_collapse& get(int tid) const {
+        if (tid < 0 || (size_t) tid >= ref_table.size()) {
+            return default_ref;
+        }
+        return ref_table[tid];
+    }
+
+    bool has_rules() const {
+        return !rules.empty();
+    }
+
+    // True if any reference is collapsed in mode; before resolve(), if
+    // the default or any rule is.
+    bool uses_mode(collapse_mode mode) const {
+        if (!ref_table.empty()) {
+            return has_ref_with(mode);
+        }
+        if (default_ref.mode == mode) {
+            return true;
+        }
+        for (const rule& lrule : rules) {
+            if (lrule.ref.mode == mode) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // True if some coordinate reference of the resolved table breaks at
+    // the default gap, i.e. is changed by another default gap.
+    bool uses_default_gap() const {
+        for (const ref_collapse& lref : ref_table) {
+            if (lref.mode == COORDINATE_COLLAPSE && !lref.fixed_gap) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Number of references per mode of the resolved table.
+    void print() const {
+        unsigned long n_feature = 0, n_coordinate = 0;
+        for (const ref_collapse& lref : ref_table) {
+            if (lref.mode == FEATURE_COLLAPSE) {
+                n_feature++;
+            } else {
+                n_coordinate++;
+            }
+        }
+        std::cout << "Collapse policy: " << n_coordinate <<
+            " coordinate references, " << n_feature << " feature references\n";
+    }
+
+    private:
+
+    struct rule {
+        std::string name;
+        bool is_prefix = false;
+        ref_collapse ref;
+    };
+
+    void parse_rules(const std::string& rules_str) {
+        std::istringstream lstream(rules_str);
+        std::string lrule_str;
+        while (std::getline(lstream, lrule_str, ',')) {
+            if (lrule_str.empty()) {
+                continue;
+            }
+            size_t eq_pos = lrule_str.find('=');
+            if (eq_pos == std::string::npos || eq_pos == 0) {
+                throw std::runtime_error("Collapse rule has to be "
+                    "<name>=<mode>[:<gap>]: " + lrule_str);
+            }
+            rule lrule;
+            lrule.name = lrule_str.substr(0, eq_pos);
+            if (lrule.name.back() == '*') {
+                lrule.is_prefix = true;
+                lrule.name.pop_back();
+            }
+            std::string mode_str = lrule_str.substr(eq_pos + 1);
+            lrule.ref.brake_gap = default_ref.brake_gap;
+            size_t colon_pos = mode_str.find(':');
+            if (colon_pos != std::string::npos) {
+                std::string gap_str = mode_str.substr(colon_pos + 1);
+                if (gap_str.empty() ||
+                    gap_str.find_first_not_of("0123456789") != std::string::npos) {
+                    throw std::runtime_error("Illegal gap in collapse rule: " +
+                        lrule_str);
+                }
+                lrule.ref.brake_gap = std::stoi(gap_str);
+                lrule.ref.fixed_gap = true;
+                mode_str = mode_str.substr(0, colon_pos);
+            }
+            lrule.ref.mode = parse_mode(mode_str);
+            rules.push_back(lrule);
+        }
+    }
+
+    bool has_ref_with(collapse_mode mode) const {
+        for (const ref_collapse& lref : ref_table) {
+            if (lref.mode == mode) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    ref_collapse default_ref;
+    std::vector<rule> rules;
+    // By reference id, filled by resolve()
+    std::vector<ref_collapse> ref_table;
+
+};
+
+#endif
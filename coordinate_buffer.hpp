@@ -0,0 +1,272 @@
+#ifndef _COORDINATE_BUFFER_HPP
+#define _COORDINATE_BUFFER_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <experimental/filesystem>
+#include <htslib/sam.h>
+#include "bam_reader.hpp"
+#include "bam_writer.hpp"
+
+// Collects alignments (the representatives of the clusters) and writes
+// them ordered by reference and position, e.g. into a coordinate sorted
+// and indexed _u.bam. The alignments are kept in their binary bam form in
+// one byte arena with a small sort entry each. Past half of mem_lim bytes
+// the arena is handed over to a spill, which sorts it and writes it into a
+// bam run under temp_prefix without holding the lock, while add() goes on
+// filling a new arena; only one spill runs at a time, so the two arenas
+// stay within mem_lim. write() merges the runs with what is left in
+// memory. Ties of position are ordered by qname, so the output does not
+// depend on the order of add(), which may be called from several threads.
+class coordinate_buffer {
+
+    public:
+
+    coordinate_buffer(bam_hdr_t* lhdr, const std::string& temp_prefix,
+            unsigned long mem_lim):
+        lhdr(lhdr),
+        temp_prefix(temp_prefix),
+        mem_lim(mem_lim) {
+        memset(&view, 0, sizeof(view));
+    }
+
+    coordinate_buffer(const coordinate_buffer&) = delete;
+    coordinate_buffer& operator=(const coordinate_buffer&) = delete;
+
+    ~coordinate_buffer() {
+        for (const std::string& run_str : run_files) {
+            std::experimental::filesystem::remove(run_str);
+        }
+    }
+
+    // Adds the alignment of a SAM line over the header.
+    void add(const char* sam_line) {
+        // The parse runs outside the lock, on a bam1_t of the thread.
+        thread_local std::unique_ptr<bam1_t, void(*)(bam1_t*)> lparsed(
+            bam_init1(), bam_destroy1);
+        kstring_t lstr;
+        lstr.s = (char*) sam_line;
+        lstr.l = strlen(sam_line);
+        lstr.m = lstr.l + 1;
+        if (sam_parse1(&lstr, lhdr, lparsed.get()) < 0) {
+            throw std::runtime_error("Could not parse read: " + std::string(sam_line));
+        }
+        add(lparsed.get());
+    }
+
+    void add(const bam1_t* lrec) {
+        std::vector<uint8_t> lspill_arena;
+        std::vector<entry> lspill_entries;
+        std::string run_str;
+        {
+            std::unique_lock<std::mutex> llock(mtx);
+            entry lentry;
+            lentry.key = get_key(lrec);
+            lentry.offset = arena.size();
+            lentry.l_data = lrec -> l_data;
+            lentry.core = lrec -> core;
+            arena.insert(arena.end(), lrec -> data, lrec -> data + lrec -> l_data);
+            entries.push_back(lentry);
+            if (get_used() <= mem_lim / 2) {
+                return;
+            }
+            spill_done.wait(llock, [this]() { return !spilling; });
+            // Another thread may have taken the arena meanwhile.
+            if (get_used() <= mem_lim / 2) {
+                return;
+            }
+            spilling = true;
+            lspill_arena.swap(arena);
+            lspill_entries.swap(entries);
+            run_str = temp_prefix + "_coord_" + std::to_string(run_files.size()) +
+                ".bam";
+        }
+        try {
+            spill(run_str, lspill_arena, lspill_entries);
+        } catch (...) {
+            std::experimental::filesystem::remove(run_str);
+            end_spill("");
+            throw;
+        }
+        end_spill(run_str);
+    }
+
+    // Writes all alignments in order; returns their number. add() must not
+    // be called meanwhile.
+    unsigned long write(bam_writer& writer) {
+        std::unique_lock<std::mutex> llock(mtx);
+        spill_done.wait(llock, [this]() { return !spilling; });
+        sort_entries(arena, entries);
+        if (run_files.empty()) {
+            for (const entry& lentry : entries) {
+                writer.write_bam(get_view(view, arena, lentry));
+            }
+            return entries.size();
+        }
+
+        // Source 0 is the arena, source j > 0 the run j - 1.
+        std::vector<std::unique_ptr<bam_reader>> readers;
+        std::vector<const bam1_t*> heads(run_files.size() + 1, NULL);
+        size_t next_entry = 0;
+        auto advance = [&](size_t j) {
+            if (j == 0) {
+                heads[0] = next_entry < entries.size() ?
+                    get_view(view, arena, entries[next_entry++]) : NULL;
+            } else {
+                heads[j] = readers[j - 1] -> read_raw();
+            }
+        };
+        auto greater = [&heads](size_t a, size_t b) {
+            return is_less(heads[b], heads[a]);
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(greater)>
+            source_pq(greater);
+        for (std::string& run_str : run_files) {
+            readers.emplace_back(new bam_reader(run_str));
+        }
+        for (size_t j = 0; j < heads.size(); j++) {
+            advance(j);
+            if (heads[j]) {
+                source_pq.push(j);
+            }
+        }
+        unsigned long lcount = 0;
+        while (!source_pq.empty()) {
+            size_t j = source_pq.top();
+            source_pq.pop();
+            writer.write_bam(heads[j]);
+            lcount++;
+            advance(j);
+            if (heads[j]) {
+                source_pq.push(j);
+            }
+        }
+        return lcount;
+    }
+
+    // Order of the output: reference, then position, then qname.
+    static bool is_less(const bam1_t* a, const bam1_t* b) {
+        uint64_t a_key = get_key(a);
+        uint64_t b_key = get_key(b);
+        if (a_key != b_key) {
+            return a_key < b_key;
+        }
+        return strcmp(bam_get_qname(a), bam_get_qname(b)) < 0;
+    }
+
+    // Copy of lhdr whose @HD line declares SO:coordinate, for the header
+    // of a coordinate sorted output; the caller destroys it.
+    static bam_hdr_t* get_coordinate_header(const bam_hdr_t* lhdr) {
+        bam_hdr_t* lsorted_hdr = bam_hdr_dup(lhdr);
+        int lres = sam_hdr_count_lines(lsorted_hdr, "HD") > 0 ?
+            sam_hdr_update_hd(lsorted_hdr, "SO", "coordinate") :
+            sam_hdr_add_line(lsorted_hdr, "HD", "VN", SAM_FORMAT_VERSION,
+                "SO", "coordinate", NULL);
+        if (lres < 0) {
+            bam_hdr_destroy(lsorted_hdr);
+            throw std::runtime_error("Could not set the sort order of the header.");
+        }
+        return lsorted_hdr;
+    }
+
+    // True if the @HD line of lhdr declares SO:coordinate.
+    static bool is_coordinate_header(bam_hdr_t* lhdr) {
+        kstring_t lso = {0, 0, NULL};
+        bool lsorted = sam_hdr_find_tag_hd(lhdr, "SO", &lso) == 0 &&
+            strcmp(lso.s, "coordinate") == 0;
+        free(lso.s);
+        return lsorted;
+    }
+
+    private:
+
+    struct entry {
+        uint64_t key;
+        size_t offset;
+        int l_data;
+        bam1_core_t core;
+    };
+
+    // Reference, then position; unmapped reads (tid -1) last.
+    static uint64_t get_key(const bam1_t* lrec) {
+        return ((uint64_t) (uint32_t) lrec -> core.tid << 32) |
+            (uint32_t) lrec -> core.pos;
+    }
+
+    // Bytes of the arena and its entries
+    unsigned long get_used() const {
+        return arena.size() + entries.size() * sizeof(entry);
+    }
+
+    // lview over the bytes of an entry of larena; valid until larena
+    // changes. The arena owns the data, the view is never freed.
+    static const bam1_t* get_view(bam1_t& lview, std::vector<uint8_t>& larena,
+            const entry& lentry) {
+        lview.core = lentry.core;
+        lview.data = &larena[lentry.offset];
+        lview.l_data = lentry.l_data;
+        lview.m_data = lentry.l_data;
+        return &lview;
+    }
+
+    static void sort_entries(const std::vector<uint8_t>& larena,
+            std::vector<entry>& lentries) {
+        std::sort(lentries.begin(), lentries.end(),
+            [&larena](const entry& a, const entry& b) {
+                if (a.key != b.key) {
+                    return a.key < b.key;
+                }
+                const char* a_qname = (const char*) &larena[a.offset];
+                const char* b_qname = (const char*) &larena[b.offset];
+                return strcmp(a_qname, b_qname) < 0;
+            });
+    }
+
+    // Sorts an arena taken out of the buffer and writes it into run_str.
+    void spill(std::string& run_str, std::vector<uint8_t>& larena,
+            std::vector<entry>& lentries) {
+        sort_entries(larena, lentries);
+        bam1_t lview;
+        memset(&lview, 0, sizeof(lview));
+        bam_writer writer(run_str, lhdr);
+        for (const entry& lentry : lentries) {
+            writer.write_bam(get_view(lview, larena, lentry));
+        }
+    }
+
+    // Adds the run of a finished spill, if any, and lets the next one start.
+    void end_spill(const std::string& run_str) {
+        {
+            std::lock_guard<std::mutex> lguard(mtx);
+            if (!run_str.empty()) {
+                run_files.push_back(run_str);
+            }
+            spilling = false;
+        }
+        spill_done.notify_all();
+    }
+
+    bam_hdr_t* lhdr;
+    std::string temp_prefix;
+    unsigned long mem_lim;
+    std::mutex mtx;
+    std::condition_variable spill_done;
+    bool spilling = false;
+    std::vector<uint8_t> arena;
+    std::vector<entry> entries;
+    std::vector<std::string> run_files;
+    bam1_t view;
+
+};
+
+#endif
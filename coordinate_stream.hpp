@@ -0,0 +1,163 @@
+#ifndef _COORDINATE_STREAM_HPP
+#define _COORDINATE_STREAM_HPP
+
+#include <string>
+#include <vector>
+#include <list>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <stdexcept>
+#include "bam_record.hpp"
+#include "umi_collapser.hpp"
+
+// Called for every pair of consecutive reads of the same ref/UMI/strand.
+typedef std::function<void(const bam_record&, const bam_record&)> gap_callback;
+
+// Coordinate collapse of a coordinate sorted stream without the external
+// sort. In coordinate mode a cluster only grows while the next read of the
+// same ref/UMI/strand starts within brake_gap of its last read, so once
+// the sweep position has passed last start + brake_gap the cluster can be
+// closed. Open clusters are kept per (UMI, strand) of the current
+// reference and dropped once closed.
+//
+// Memory is not strictly bounded: all reads of an open cluster are held
+// in memory until it closes (there is no spill), so the reads held are
+// those of the UMIs active within brake_gap of the sweep position, however
+// deep their clusters are. On top of that, the gap file needs the last
+// read of every UMI/strand seen on the current reference, also beyond
+// brake_gap, so last_map keeps its start and end until the reference
+// changes.
+//
+// Closed clusters are fed to a umi_collapser with their reads in
+// compare_bam_less order. Consecutive clusters handed over this way always
+// break, so the collapser finds the same clusters and representatives as
+// after the sort. The gap is the one of the current reference in
+// coll_policy, which must not use the feature collapse.
+class coordinate_stream {
+
+    public:
+
+    coordinate_stream(const collapse_policy& coll_policy,
+            umi_collapser& collapser, gap_callback gap_cb):
+        coll_policy(coll_policy),
+        collapser(collapser),
+        gap_cb(gap_cb) {
+        if (coll_policy.uses_mode(FEATURE_COLLAPSE)) {
+            throw std::runtime_error("Streaming needs the coordinate collapse.");
+        }
+    }
+
+    // Reads have to arrive ordered by reference and start position.
+    void add_record(const bam_record& lrec) {
+        if (lrec.ref_name_id != cur_ref) {
+            if (lrec.ref_name_id < cur_ref) {
+                throw std::runtime_error("Input is not coordinate sorted at qname: " +
+                    std::string(lrec.qname));
+            }
+            close_all();
+            last_map.clear();
+            cur_ref = lrec.ref_name_id;
+            // The policy rejects negative gaps.
+            brake_gap = (unsigned long) coll_policy.get(cur_ref).brake_gap;
+            sweep_pos = 0;
+        }
+        if (lrec.start_pos < sweep_pos) {
+            throw std::runtime_error("Input is not coordinate sorted at qname: " +
+                std::string(lrec.qname));
+        }
+        sweep_pos = lrec.start_pos;
+
+        // Close every cluster whose last read is more than brake_gap
+        // behind. The order list is sorted by last start.
+        while (!order_list.empty()) {
+            auto lfront = open_map.find(order_list.front());
+            if ((sweep_pos - lfront -> second.last_start) > brake_gap) {
+                close_cluster(lfront -> second);
+                open_map.erase(lfront);
+                order_list.pop_front();
+            } else {
+                break;
+            }
+        }
+
+        std::string lkey = std::string(lrec.umi) + lrec.strand;
+        if (gap_cb) {
+            auto llast = last_map.find(lkey);
+            if (llast != last_map.end()) {
+                // Only the fields used for the gaps are set.
+                bam_record last_rec(true, cur_ref, lrec.umi, lrec.strand,
+                    llast -> second.start_pos, llast -> second.end_pos,
+                    (char*) "", (char*) "", -1);
+                gap_cb(last_rec, lrec);
+                llast -> second = last_read{lrec.start_pos, lrec.end_pos};
+            } else {
+                last_map.emplace(lkey, last_read{lrec.start_pos, lrec.end_pos});
+            }
+        }
+        auto lit = open_map.find(lkey);
+        if (lit != open_map.end()) {
+            order_list.erase(lit -> second.order_it);
+        }
+        open_cluster& lcluster = open_map[lkey];
+        lcluster.recs.push_back(lrec);
+        lcluster.last_start = lrec.start_pos;
+        order_list.push_back(lkey);
+        lcluster.order_it = std::prev(order_list.end());
+    }
+
+    void finish() {
+        close_all();
+        last_map.clear();
+    }
+
+    private:
+
+    struct open_cluster {
+        std::vector<bam_record> recs;
+        unsigned long last_start = 0;
+        std::list<std::string>::iterator order_it;
+    };
+
+    // Last read of a UMI/strand on the reference, for the gap to its next
+    // read, also across clusters.
+    struct last_read {
+        unsigned long start_pos;
+        unsigned long end_pos;
+    };
+
+    void close_cluster(open_cluster& lcluster) {
+        // Reads starting at the same position are ordered by qname after
+        // the sort; restore that order so that the representative is the
+        // same.
+        std::stable_sort(lcluster.recs.begin(), lcluster.recs.end(),
+            compare_bam_less());
+        for (const bam_record& lrec : lcluster.recs) {
+            collapser.add_record(lrec);
+        }
+        lcluster.recs.clear();
+    }
+
+    void close_all() {
+        for (const std::string& lkey : order_list) {
+            close_cluster(open_map[lkey]);
+        }
+        order_list.clear();
+        open_map.clear();
+    }
+
+    collapse_policy coll_policy;
+    unsigned long brake_gap = 0;
+    umi_collapser& collapser;
+    gap_callback gap_cb;
+    int cur_ref = -1;
+    unsigned long sweep_pos = 0;
+    std::unordered_map<std::string, open_cluster> open_map;
+    std::unordered_map<std::string, last_read> last_map;
+    // Keys of the open clusters, oldest last start first
+    std::list<std::string> order_list;
+
+};
+
+#endif
@@ -0,0 +1,190 @@
+#ifndef _COUNT_MATRIX_HPP
+#define _COUNT_MATRIX_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <unordered_map>
+#include <stdexcept>
+#include <htslib/sam.h>
+#include <regex.h>
+
+// Number of collapsed transcripts per (reference, cell), built while the
+// clusters are emitted and written as a Matrix Market sparse matrix. Rows
+// are the references of the header (the features in feature mode) and
+// columns are the cells. The cell is parsed from the qname with
+// cell_regex_str, a POSIX extended regex with one capture group; without
+// it every count goes to the single column "all".
+class count_matrix {
+
+    public:
+
+    count_matrix(const std::string& cell_regex_str) {
+        if (!cell_regex_str.empty()) {
+            if (regcomp(&cell_regex, cell_regex_str.c_str(), REG_EXTENDED)) {
+                throw std::runtime_error("Could not compile cell regex: " +
+                    cell_regex_str);
+            }
+            has_regex = true;
+        }
+    }
+
+    count_matrix(const count_matrix&) = delete;
+    count_matrix& operator=(const count_matrix&) = delete;
+
+    // Counts one cluster of reference ref_id whose reads carry qname.
+    void add_cluster(int ref_id, const char* qname) {
+        if (ref_id < 0) {
+            return;
+        }
+        uint32_t cell_id = get_cell_id(qname);
+        uint64_t lkey = ((uint64_t) ref_id << 32) | cell_id;
+        counts[lkey]++;
+    }
+
+    // Writes <path_prefix>_counts.mtx together with the row names in
+    // <path_prefix>_features.tsv and the column names in
+    // <path_prefix>_cells.tsv.
+    void write(const std::string& path_prefix, bam_hdr_t* lhdr) {
+        std::string mtx_str = path_prefix + "_counts.mtx";
+        std::string features_str = path_prefix + "_features.tsv";
+        std::string cells_str = path_prefix + "_cells.tsv";
+
+        std::vector<std::pair<uint64_t, uint32_t>> entries(counts.begin(),
+            counts.end());
+        // Column major, as is usual for count matrices.
+        std::sort(entries.begin(), entries.end(),
+            [](const std::pair<uint64_t, uint32_t>& a,
+                const std::pair<uint64_t, uint32_t>& b) {
+                uint64_t a_cell = a.first & 0xffffffffULL;
+                uint64_t b_cell = b.first & 0xffffffffULL;
+                if (a_cell != b_cell) {
+                    return a_cell < b_cell;
+                }
+                return a.first < b.first;
+            });
+
+        int n_targets = lhdr -> n_targets;
+        std::ofstream mtx_writer(mtx_str);
+        mtx_writer << "%%MatrixMarket matrix coordinate integer general\n";
+        mtx_writer << n_targets << " " << cell_names.size() << " " <<
+            entries.size() << "\n";
+        for (const auto& lentry : entries) {
+            uint64_t ref_id = lentry.first >> 32;
+            uint64_t cell_id = lentry.first & 0xffffffffULL;
+            mtx_writer << (ref_id + 1) << " " << (cell_id + 1) << " " <<
+                lentry.second << "\n";
+        }
+
+        std::ofstream features_writer(features_str);
+        for (int tid = 0; tid < n_targets; tid++) {
+            features_writer << sam_hdr_tid2name(lhdr, tid) << "\n";
+        }
+
+        std::ofstream cells_writer(cells_str);
+        for (const std::string& lcell : cell_names) {
+            cells_writer << lcell << "\n";
+        }
+        std::cout << "Wrote count matrix: " << mtx_str << "\n";
+    }
+
+    // Adds the counts of a matrix written by write() over the same header,
+    // e.g. by one partition of a scattered library.
+    void read(const std::string& path_prefix) {
+        std::string mtx_str = path_prefix + "_counts.mtx";
+        std::string cells_str = path_prefix + "_cells.tsv";
+
+        std::ifstream cells_reader(cells_str);
+        if (!cells_reader.is_open()) {
+            throw std::runtime_error("Could not open: " + cells_str);
+        }
+        std::vector<uint32_t> cell_map;
+        std::string lcell;
+        while (std::getline(cells_reader, lcell)) {
+            cell_map.push_back(get_cell_index(lcell));
+        }
+
+        std::ifstream mtx_reader(mtx_str);
+        if (!mtx_reader.is_open()) {
+            throw std::runtime_error("Could not open: " + mtx_str);
+        }
+        std::string line;
+        bool size_line = true;
+        while (std::getline(mtx_reader, line)) {
+            if (line.empty() || line[0] == '%') {
+                continue;
+            }
+            std::istringstream lstream(line);
+            uint64_t row = 0, col = 0, lcount = 0;
+            lstream >> row >> col >> lcount;
+            if (size_line) {
+                size_line = false;
+                continue;
+            }
+            if (row == 0 || col == 0 || col > cell_map.size()) {
+                throw std::runtime_error("Malformed entry in " + mtx_str +
+                    ": " + line);
+            }
+            uint64_t lkey = ((row - 1) << 32) | cell_map[col - 1];
+            counts[lkey] += lcount;
+        }
+    }
+
+    // Adds the counts of another matrix over the same header; the cells
+    // are matched by name.
+    void add(const count_matrix& other) {
+        for (const auto& lentry : other.counts) {
+            uint64_t cell_id = lentry.first & 0xffffffffULL;
+            uint64_t lkey = (lentry.first & ~0xffffffffULL) |
+                get_cell_index(other.cell_names[cell_id]);
+            counts[lkey] += lentry.second;
+        }
+    }
+
+    ~count_matrix() {
+        if (has_regex) {
+            regfree(&cell_regex);
+        }
+    }
+
+    private:
+
+    uint32_t get_cell_id(const char* qname) {
+        std::string lcell = "all";
+        if (has_regex) {
+            regmatch_t pmatch[2];
+            if (regexec(&cell_regex, qname, 2, pmatch, 0) ||
+                pmatch[1].rm_so < 0) {
+                std::string err_str = "cell barcode not found, qname: " +
+                    std::string(qname);
+                throw std::runtime_error(err_str);
+            }
+            lcell.assign(qname + pmatch[1].rm_so,
+                pmatch[1].rm_eo - pmatch[1].rm_so);
+        }
+        return get_cell_index(lcell);
+    }
+
+    uint32_t get_cell_index(const std::string& lcell) {
+        auto lit = cell_ids.find(lcell);
+        if (lit != cell_ids.end()) {
+            return lit -> second;
+        }
+        uint32_t cell_id = cell_names.size();
+        cell_ids.emplace(lcell, cell_id);
+        cell_names.push_back(lcell);
+        return cell_id;
+    }
+
+    bool has_regex = false;
+    regex_t cell_regex;
+    std::unordered_map<std::string, uint32_t> cell_ids;
+    std::vector<std::string> cell_names;
+    std::unordered_map<uint64_t, uint32_t> counts;
+
+};
+
+#endif
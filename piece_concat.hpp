@@ -0,0 +1,149 @@
+#ifndef _PIECE_CONCAT_HPP
+#define _PIECE_CONCAT_HPP
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+
+// Appends the outputs written by the key ranges p > 0 of a parallel final
+// pass (the pieces) to the outputs of range 0, in range order.
+//
+// Bam pieces are appended as raw bgzf blocks: htslib flushes the header
+// into blocks of its own, so the records of a piece start at a block
+// boundary and the blocks from there on are copied without decompressing
+// them. The empty EOF block is kept only at the end of the result.
+class piece_concat {
+
+    public:
+
+    // Appends the blocks of piece_str from record_voffset (the virtual
+    // offset of its first record) to dest_str. Returns the shift of the
+    // compressed offsets of the appended blocks, see shift_voffset.
+    static long append_bgzf(const std::string& dest_str,
+            const std::string& piece_str, long record_voffset) {
+        if (record_voffset < 0 || (record_voffset & 0xffff) != 0) {
+            throw std::runtime_error("Records do not start at a block boundary: " +
+                piece_str);
+        }
+        long lstart = record_voffset >> 16;
+
+        FILE* dest_fp = fopen(dest_str.c_str(), "r+b");
+        if (!dest_fp) {
+            throw std::runtime_error("Could not open: " + dest_str);
+        }
+        long ldest_pos = get_data_end(dest_fp, dest_str);
+        FILE* piece_fp = fopen(piece_str.c_str(), "rb");
+        if (!piece_fp) {
+            fclose(dest_fp);
+            throw std::runtime_error("Could not open: " + piece_str);
+        }
+        long lpiece_end = get_data_end(piece_fp, piece_str);
+
+        std::vector<char> buffer(1 << 20);
+        bool ok = fseek(piece_fp, lstart, SEEK_SET) == 0 &&
+            fseek(dest_fp, ldest_pos, SEEK_SET) == 0;
+        long lleft = lpiece_end - lstart;
+        while (ok && lleft > 0) {
+            size_t lchunk = std::min((long) buffer.size(), lleft);
+            ok = fread(buffer.data(), 1, lchunk, piece_fp) == lchunk &&
+                fwrite(buffer.data(), 1, lchunk, dest_fp) == lchunk;
+            lleft -= lchunk;
+        }
+        ok = ok && fwrite(get_bgzf_eof(), 1, eof_len, dest_fp) == (size_t) eof_len;
+        fclose(piece_fp);
+        if (fclose(dest_fp) != 0 || !ok) {
+            throw std::runtime_error("Could not append " + piece_str + " to " +
+                dest_str);
+        }
+        return ldest_pos - lstart;
+    }
+
+    static long shift_voffset(long voffset, long shift) {
+        return voffset < 0 ? voffset : voffset + (shift << 16);
+    }
+
+    // Appends the bytes of piece_str; plain text and bgzf text alike.
+    static void append_text(const std::string& dest_str,
+            const std::string& piece_str) {
+        std::ofstream out_writer(dest_str, std::ios::binary | std::ios::app);
+        std::ifstream piece_reader(piece_str, std::ios::binary);
+        if (!out_writer.is_open() || !piece_reader.is_open()) {
+            throw std::runtime_error("Could not append " + piece_str + " to " +
+                dest_str);
+        }
+        if (piece_reader.peek() != std::ifstream::traits_type::eof()) {
+            out_writer << piece_reader.rdbuf();
+        }
+    }
+
+    // Appends the lines of a cluster index piece with the offsets moved by
+    // the shifts of its _sorted and _u pieces.
+    static void append_cluster_index(const std::string& dest_str,
+            const std::string& piece_str, long sorted_shift, long u_shift) {
+        std::ifstream piece_reader(piece_str);
+        if (!piece_reader.is_open()) {
+            throw std::runtime_error("Could not open: " + piece_str);
+        }
+        std::ofstream out_writer(dest_str, std::ios::app);
+        std::string line;
+        while (std::getline(piece_reader, line)) {
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            // The offsets are the last two columns.
+            size_t u_pos = line.rfind('\t');
+            size_t sorted_pos = u_pos == std::string::npos || u_pos == 0 ?
+                std::string::npos : line.rfind('\t', u_pos - 1);
+            if (sorted_pos == std::string::npos) {
+                throw std::runtime_error("Malformed line in " + piece_str +
+                    ": " + line);
+            }
+            long sorted_offset = std::stol(line.substr(sorted_pos + 1,
+                u_pos - sorted_pos - 1));
+            long u_offset = std::stol(line.substr(u_pos + 1));
+            out_writer << line.substr(0, sorted_pos) << '\t' <<
+                shift_voffset(sorted_offset, sorted_shift) << '\t' <<
+                shift_voffset(u_offset, u_shift) << '\n';
+        }
+        if (!out_writer) {
+            throw std::runtime_error("Could not append " + piece_str + " to " +
+                dest_str);
+        }
+    }
+
+    private:
+
+    // Size of the file without a trailing bgzf EOF block.
+    static long get_data_end(FILE* fp, const std::string& file_str) {
+        if (fseek(fp, 0, SEEK_END) != 0) {
+            throw std::runtime_error("Could not seek in: " + file_str);
+        }
+        long lsize = ftell(fp);
+        if (lsize >= eof_len) {
+            char ltail[eof_len];
+            if (fseek(fp, lsize - eof_len, SEEK_SET) == 0 &&
+                fread(ltail, 1, eof_len, fp) == (size_t) eof_len &&
+                memcmp(ltail, get_bgzf_eof(), eof_len) == 0) {
+                return lsize - eof_len;
+            }
+        }
+        return lsize;
+    }
+
+    static const char* get_bgzf_eof() {
+        static const char bgzf_eof[eof_len + 1] = "\037\213\010\4\0\0\0\0\0"
+            "\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
+        return bgzf_eof;
+    }
+
+    // The empty block htslib writes at the end of every bgzf file
+    static const long eof_len = 28;
+
+};
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef _READ_FILTER_HPP
+#define _READ_FILTER_HPP
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <htslib/sam.h>
+
+// Predicate on the core fields of a raw alignment, evaluated by bam_reader
+// before a read is formatted or its UMI is parsed. Reads failing it are
+// dropped without being decoded.
+class read_filter {
+
+    public:
+
+    read_filter() = default;
+
+    read_filter(unsigned int exclude_flags, unsigned int min_mapq):
+        exclude_flags(exclude_flags),
+        min_mapq(min_mapq) {
+    }
+
+    // Resolves the comma separated reference names against the header.
+    // With a non empty include list only those references pass; references
+    // on the exclude list never pass.
+    void set_refs(bam_hdr_t* lhdr, const std::string& include_str,
+            const std::string& exclude_str) {
+        std::vector<std::string> include_refs = split_names(include_str);
+        std::vector<std::string> exclude_refs = split_names(exclude_str);
+        ref_mask.clear();
+        if (include_refs.empty() && exclude_refs.empty()) {
+            return;
+        }
+
+        int n_targets = lhdr -> n_targets;
+        ref_mask.assign(n_targets, include_refs.empty() ? 1 : 0);
+        for (const std::string& lname : include_refs) {
+            int tid = get_tid(lhdr, lname);
+            if (tid >= 0) {
+                ref_mask[tid] = 1;
+            }
+        }
+        for (const std::string& lname : exclude_refs) {
+            int tid = get_tid(lhdr, lname);
+            if (tid >= 0) {
+                ref_mask[tid] = 0;
+            }
+        }
+    }
+
+    bool pass(const bam1_t* lread) const {
+        const bam1_core_t& lcore = lread -> core;
+        if (lcore.flag & exclude_flags) {
+            return false;
+        }
+        if (lcore.qual < min_mapq) {
+            return false;
+        }
+        if (!ref_mask.empty()) {
+            if (lcore.tid < 0 || lcore.tid >= (int) ref_mask.size() ||
+                !ref_mask[lcore.tid]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    private:
+
+    static std::vector<std::string> split_names(const std::string& names_str) {
+        std::vector<std::string> names;
+        std::stringstream lstream(names_str);
+        std::string lname;
+        while (std::getline(lstream, lname, ',')) {
+            if (!lname.empty()) {
+                names.push_back(lname);
+            }
+        }
+        return names;
+    }
+
+    static int get_tid(bam_hdr_t* lhdr, const std::string& lname) {
+        int tid = sam_hdr_name2tid(lhdr, lname.c_str());
+        if (tid < 0) {
+            std::cout << "Warning: reference not in the header: " << lname << "\n";
+        }
+        return tid;
+    }
+
+    unsigned int exclude_flags = BAM_FUNMAP;
+    unsigned int min_mapq = 0;
+    // Indexed by tid; empty when every reference passes.
+    std::vector<char> ref_mask;
+
+};
+
+#endif
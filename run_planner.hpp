@@ -0,0 +1,308 @@
+#ifndef _RUN_PLANNER_HPP
+#define _RUN_PLANNER_HPP
+
+#include <cmath>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <htslib/sam.h>
+#include "bam_reader.hpp"
+#include "bam_record.hpp"
+#include "read_filter.hpp"
+#include "run_sorter.hpp"
+
+// Resources and sizes chosen for one run of umi_norm. size_lim is in the
+// units of bam_record::get_size, as compared by umi_norm_engine.
+struct run_plan {
+    unsigned long mem_bytes = 0;
+    unsigned long size_lim = 0;
+    unsigned int num_threads = 1;
+    unsigned int max_fan_in = 0;
+
+    // What the plan was based on
+    unsigned long sampled_reads = 0;
+    double kept_frac = 1.0;
+    double mean_rec_size = 0;
+    double mem_factor = 0;
+    long est_reads = -1;
+    unsigned long est_runs = 0;
+    unsigned int merge_passes = 0;
+
+    void print() const {
+        std::cout << "Plan: memory budget " << (mem_bytes / 1000000) << "M"
+            << ", run size " << (size_lim / 1000000) << "M"
+            << ", threads " << num_threads
+            << ", merge fan-in " << max_fan_in << "\n";
+        std::cout << "Plan: sampled " << sampled_reads << " reads, kept "
+            << kept_frac << ", " << mean_rec_size << " bytes per read, "
+            << "memory factor " << mem_factor << "\n";
+        if (est_reads >= 0) {
+            std::cout << "Plan: about " << est_reads << " reads, " << est_runs
+                << " runs, " << merge_passes << " merge passes\n";
+        }
+        std::cout << "Plan: rerun with -s " << (size_lim / 1000000) << " -t "
+            << num_threads << " --fan_in " << max_fan_in
+            << " --memory_factor " << mem_factor << "\n";
+    }
+};
+
+// Chooses the memory budget, the run size, the number of threads and the
+// merge fan-in. The input is sampled at its head for the size of a read in
+// memory and the fraction passing the filter, and the number of reads is
+// taken from the index or extrapolated from the file size. Memory and
+// cpus are limited by the cgroup of the process. Values given by the user
+// (non zero) are kept.
+class run_planner {
+
+    public:
+
+    run_planner(const std::string& infile_str, const std::string& format_str,
+            const std::string& ref_str, const read_filter* filter,
+            size_t umi_len = 6):
+        infile_str(infile_str),
+        format_str(format_str),
+        ref_str(ref_str),
+        filter(filter),
+        umi_len(umi_len) {
+    }
+
+    run_plan make_plan(unsigned int size_lim_M, unsigned int num_threads,
+            unsigned int max_fan_in, double mem_factor) {
+        run_plan plan;
+        // stdin can not be read twice.
+        if (infile_str != "-") {
+            sample(plan);
+        }
+        if (mem_factor > 0) {
+            plan.mem_factor = mem_factor;
+        } else if (plan.mem_factor <= 0) {
+            plan.mem_factor = default_mem_factor;
+        }
+
+        plan.num_threads = num_threads > 0 ? num_threads : get_cpu_count();
+
+        if (size_lim_M > 0) {
+            plan.size_lim = (unsigned long) size_lim_M * 1000000;
+            plan.mem_bytes = plan.size_lim * plan.mem_factor;
+        } else {
+            plan.mem_bytes = get_available_memory() * mem_share;
+            plan.size_lim = plan.mem_bytes / plan.mem_factor;
+            if (plan.size_lim < min_size_lim) {
+                plan.size_lim = min_size_lim;
+            }
+        }
+
+        // Every run of a merge has a reader thread, a file and its
+        // read-ahead; below min_readahead_bytes per run the merge turns
+        // into small random reads.
+        if (max_fan_in > 0) {
+            plan.max_fan_in = max_fan_in;
+        } else {
+            unsigned long lfan_in = (plan.size_lim / 2) / min_readahead_bytes;
+            lfan_in = std::min(lfan_in, get_file_limit() / 2);
+            lfan_in = std::min(lfan_in, (unsigned long) max_auto_fan_in);
+            plan.max_fan_in = std::max(lfan_in, 2UL);
+        }
+
+        if (plan.est_reads >= 0 && plan.mean_rec_size > 0) {
+            double lbytes = plan.est_reads * plan.kept_frac * plan.mean_rec_size;
+            plan.est_runs = (unsigned long) std::ceil(lbytes / plan.size_lim);
+            unsigned long lruns = plan.est_runs;
+            while (lruns > 1) {
+                plan.merge_passes++;
+                lruns = (lruns + plan.max_fan_in - 1) / plan.max_fan_in;
+            }
+        }
+        return plan;
+    }
+
+    // Smallest of the cgroup (v2 or v1) memory limit minus its usage and
+    // MemAvailable of /proc/meminfo.
+    static unsigned long get_available_memory() {
+        unsigned long lavail = read_meminfo("MemAvailable:");
+        unsigned long llimit = 0;
+        if (read_number("/sys/fs/cgroup/memory.max", llimit)) {
+            unsigned long lused = 0;
+            read_number("/sys/fs/cgroup/memory.current", lused);
+            lavail = std::min(lavail, llimit > lused ? llimit - lused : 0UL);
+        } else if (read_number("/sys/fs/cgroup/memory/memory.limit_in_bytes", llimit)) {
+            unsigned long lused = 0;
+            read_number("/sys/fs/cgroup/memory/memory.usage_in_bytes", lused);
+            lavail = std::min(lavail, llimit > lused ? llimit - lused : 0UL);
+        }
+        if (lavail == 0) {
+            lavail = default_mem_bytes;
+        }
+        return lavail;
+    }
+
+    // Cpus of the affinity mask, further limited by the cgroup cpu quota.
+    static unsigned int get_cpu_count() {
+        unsigned int lcount = std::thread::hardware_concurrency();
+        cpu_set_t lset;
+        if (sched_getaffinity(0, sizeof(lset), &lset) == 0) {
+            lcount = CPU_COUNT(&lset);
+        }
+
+        double lquota = -1;
+        std::ifstream cpu_max("/sys/fs/cgroup/cpu.max");
+        std::string lquota_str;
+        double lperiod = 0;
+        if (cpu_max >> lquota_str >> lperiod) {
+            if (lquota_str != "max" && lperiod > 0) {
+                lquota = std::stod(lquota_str) / lperiod;
+            }
+        } else {
+            unsigned long lquota_us = 0, lperiod_us = 0;
+            // A quota of -1 (no limit) does not parse as unsigned.
+            if (read_number("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", lquota_us) &&
+                read_number("/sys/fs/cgroup/cpu/cpu.cfs_period_us", lperiod_us) &&
+                lperiod_us > 0) {
+                lquota = (double) lquota_us / lperiod_us;
+            }
+        }
+        if (lquota > 0) {
+            lcount = std::min(lcount, (unsigned int) std::ceil(lquota));
+        }
+        return lcount > 0 ? lcount : 1;
+    }
+
+    private:
+
+    void sample(run_plan& plan) {
+        std::string lfile_str = infile_str;
+        bam_reader reader(lfile_str, format_str, ref_str);
+        bam_hdr_t* lhdr = reader.get_sam_header();
+        long lstart_offset = reader.get_compressed_offset();
+
+        unsigned long lread_count = 0, lkept = 0;
+        double lsize_sum = 0, lmem_sum = 0, ltext_sum = 0;
+        bam1_t* lread = NULL;
+        while (lread_count < sample_reads && (lread = reader.read_raw()) != NULL) {
+            lread_count++;
+            if ((filter && !filter -> pass(lread)) ||
+                (lread -> core.flag & BAM_FUNMAP)) {
+                continue;
+            }
+            lkept++;
+            bam_record lrec;
+            bam_reader::decode_record(lhdr, lread, lrec, umi_len);
+            size_t ltext_len = strlen(lrec.full_rec) + 1;
+            lsize_sum += lrec.get_size();
+            lmem_sum += get_mem_size(lrec, ltext_len);
+            ltext_sum += ltext_len;
+        }
+        plan.sampled_reads = lread_count;
+        if (lread_count == 0) {
+            return;
+        }
+        plan.kept_frac = (double) lkept / lread_count;
+        if (lkept > 0) {
+            plan.mean_rec_size = lsize_sum / lkept;
+            plan.mem_factor = lmem_sum / lsize_sum;
+        }
+
+        long lindexed = reader.get_indexed_count();
+        if (lindexed >= 0) {
+            plan.est_reads = lindexed;
+        } else if (lread == NULL) {
+            // The whole file fit into the sample.
+            plan.est_reads = lread_count;
+        } else {
+            struct stat lstat;
+            if (stat(infile_str.c_str(), &lstat) != 0) {
+                return;
+            }
+            long lend_offset = reader.get_compressed_offset();
+            double lbytes_per_read = 0;
+            if (lstart_offset >= 0 && lend_offset > lstart_offset) {
+                lbytes_per_read = (double) (lend_offset - lstart_offset) / lread_count;
+            } else if (format_str == "sam" ||
+                (format_str.empty() && reader.has_suffix(infile_str, "sam"))) {
+                // Only the kept reads were formatted; they stand in for all.
+                lbytes_per_read = lkept > 0 ? ltext_sum / lkept : 0;
+            }
+            if (lbytes_per_read > 0) {
+                plan.est_reads = lstat.st_size / lbytes_per_read;
+            }
+        }
+    }
+
+    // Bytes a record takes in the split buffer: the vector slot (with the
+    // slack of its growth), the three heap strings with the allocator
+    // header and rounding, and the keys of run_sorter.
+    static double get_mem_size(const bam_record& lrec, size_t ltext_len) {
+        return 1.5 * sizeof(bam_record) +
+            get_alloc_size(strlen(lrec.umi) + 1) +
+            get_alloc_size(strlen(lrec.qname) + 1) +
+            get_alloc_size(ltext_len) +
+            2 * sizeof(run_sort_key);
+    }
+
+    static size_t get_alloc_size(size_t len) {
+        return std::max((size_t) 32, (len + 8 + 15) & ~((size_t) 15));
+    }
+
+    static unsigned long read_meminfo(const std::string& key) {
+        std::ifstream meminfo("/proc/meminfo");
+        std::string lname;
+        unsigned long lkb = 0;
+        std::string lunit;
+        while (meminfo >> lname >> lkb >> lunit) {
+            if (lname == key) {
+                return lkb * 1024;
+            }
+        }
+        return 0;
+    }
+
+    // False if the file is missing or does not hold a number (e.g. "max").
+    static bool read_number(const std::string& path_str, unsigned long& val) {
+        std::ifstream lfile(path_str);
+        std::string lstr;
+        if (!(lfile >> lstr) || lstr.empty() ||
+            lstr.find_first_not_of("0123456789") != std::string::npos) {
+            return false;
+        }
+        val = std::stoul(lstr);
+        // cgroup v1 reports no limit as a huge number.
+        if (val > (1UL << 60)) {
+            return false;
+        }
+        return true;
+    }
+
+    static unsigned long get_file_limit() {
+        struct rlimit lrlimit;
+        if (getrlimit(RLIMIT_NOFILE, &lrlimit) != 0 ||
+            lrlimit.rlim_cur == RLIM_INFINITY) {
+            return max_auto_fan_in * 2;
+        }
+        return lrlimit.rlim_cur;
+    }
+
+    static constexpr double default_mem_factor = 2.0;
+    // Share of the available memory given to the sort; the rest is
+    // left to htslib, the writers and the cluster spill.
+    static constexpr double mem_share = 0.6;
+    static const unsigned long default_mem_bytes = 1000000000UL;
+    static const unsigned long min_size_lim = 10000000UL;
+    static const unsigned long min_readahead_bytes = 4000000UL;
+    static const unsigned long max_auto_fan_in = 256;
+    static const unsigned long sample_reads = 20000;
+
+    std::string infile_str;
+    std::string format_str;
+    std::string ref_str;
+    const read_filter* filter;
+    size_t umi_len;
+
+};
+
+#endif
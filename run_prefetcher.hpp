@@ -0,0 +1,162 @@
+#ifndef _RUN_PREFETCHER_HPP
+#define _RUN_PREFETCHER_HPP
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include "bam_reader.hpp"
+#include "bam_record.hpp"
+
+// Wraps a bam_reader over one sorted run and keeps a read-ahead buffer
+// in front of it. A background thread decodes records into blocks of
+// roughly block_bytes each; the merge loop consumes them from memory, so
+// the run file is read sequentially in large chunks instead of one
+// record at a time whenever the run wins the heap.
+class run_prefetcher {
+
+    public:
+
+    // With start_offset and end_offset (bgzf virtual offsets, -1 for the
+    // start and the end of the file) only that part of the run is read.
+    // ref_str is the fasta reference of a cram run. Reads failing filter,
+    // if given, are skipped; it has to outlive the prefetcher.
+    run_prefetcher(std::string& infile_str, unsigned long buffer_bytes,
+            long start_offset = -1, long end_offset = -1, size_t umi_len = 6,
+            const std::string& ref_str = "", const read_filter* filter = NULL):
+        reader(infile_str, "", ref_str),
+        umi_len(umi_len) {
+        reader.set_filter(filter);
+        // At most three blocks are alive per run: the one being consumed,
+        // one queued and one being filled.
+        block_bytes = buffer_bytes / 3;
+        if (block_bytes < min_block_bytes) {
+            block_bytes = min_block_bytes;
+        }
+        unsigned long hfile_bytes = block_bytes;
+        if (hfile_bytes > max_hfile_bytes) {
+            hfile_bytes = max_hfile_bytes;
+        }
+        reader.set_block_size(hfile_bytes);
+        if (start_offset >= 0) {
+            reader.seek(start_offset);
+        }
+        reader.set_end_offset(end_offset);
+        filler = std::thread(&run_prefetcher::fill_loop, this);
+    }
+
+    run_prefetcher(const run_prefetcher&) = delete;
+    run_prefetcher& operator=(const run_prefetcher&) = delete;
+
+    // Returns false when the run is exhausted.
+    bool read_record(bam_record& bam_rec) {
+        if (cur_pos == cur_block.size()) {
+            if (!next_block()) {
+                return false;
+            }
+        }
+        bam_rec = std::move(cur_block[cur_pos]);
+        cur_pos++;
+        return true;
+    }
+
+    ~run_prefetcher() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stop = true;
+        }
+        cv_not_full.notify_all();
+        if (filler.joinable()) {
+            filler.join();
+        }
+    }
+
+    private:
+
+    bool next_block() {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv_not_empty.wait(lock, [this] { return !blocks.empty() || done; });
+        if (blocks.empty()) {
+            if (fill_error) {
+                std::rethrow_exception(fill_error);
+            }
+            return false;
+        }
+        cur_block = std::move(blocks.front());
+        blocks.pop_front();
+        cur_pos = 0;
+        lock.unlock();
+        cv_not_full.notify_one();
+        return true;
+    }
+
+    void fill_loop() {
+        try {
+            bool eof = false;
+            bam_batch batch(batch_size, umi_len);
+            while (!eof) {
+                std::vector<bam_record> lblock;
+                unsigned long used_size = 0;
+                while (used_size < block_bytes) {
+                    if (reader.read_batch(batch) == 0) {
+                        eof = true;
+                        break;
+                    }
+                    bam_hdr_t* lhdr = reader.get_sam_header();
+                    for (size_t i = 0; i < batch.size(); i++) {
+                        bam_record lrec;
+                        bam_reader::decode_batch_record(lhdr, batch, i, lrec);
+                        used_size += lrec.get_size();
+                        lblock.push_back(std::move(lrec));
+                    }
+                }
+
+                std::unique_lock<std::mutex> lock(mtx);
+                cv_not_full.wait(lock, [this] {
+                    return blocks.size() < max_blocks || stop; });
+                if (stop) {
+                    break;
+                }
+                if (!lblock.empty()) {
+                    blocks.push_back(std::move(lblock));
+                }
+                lock.unlock();
+                cv_not_empty.notify_one();
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mtx);
+            fill_error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            done = true;
+        }
+        cv_not_empty.notify_one();
+    }
+
+    static const unsigned long min_block_bytes = 64 * 1024;
+    static const unsigned long max_hfile_bytes = 8 * 1024 * 1024;
+    static const size_t max_blocks = 1;
+    static const size_t batch_size = 256;
+
+    bam_reader reader;
+    size_t umi_len;
+    unsigned long block_bytes;
+
+    std::vector<bam_record> cur_block;
+    size_t cur_pos = 0;
+
+    std::deque<std::vector<bam_record>> blocks;
+    std::mutex mtx;
+    std::condition_variable cv_not_full;
+    std::condition_variable cv_not_empty;
+    bool done = false;
+    bool stop = false;
+    std::exception_ptr fill_error;
+    std::thread filler;
+
+};
+
+#endif
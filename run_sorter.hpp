@@ -0,0 +1,278 @@
+#ifndef _RUN_SORTER_HPP
+#define _RUN_SORTER_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <array>
+#include <thread>
+#include <algorithm>
+#include "bam_record.hpp"
+
+// Compact sort key of one record in a run buffer. The fields are laid out
+// so that comparing (ref, umi_strand, pos) gives the compare_bam_less
+// order up to the final qname tie break.
+struct run_sort_key {
+    uint64_t umi_strand;
+    uint64_t pos;
+    uint32_t ref;
+    uint32_t index;
+};
+
+// Sorts a run buffer in compare_bam_less order by running a parallel LSD
+// radix sort on (key, index) pairs instead of moving whole bam_record
+// objects around. Records whose UMI cannot be packed into a fixed width
+// key fall back to a comparison sort.
+class run_sorter {
+
+    public:
+
+    run_sorter(unsigned int num_threads): num_threads(num_threads) {
+        if (this -> num_threads == 0) {
+            this -> num_threads = 1;
+        }
+    }
+
+    // Returns the indices of brvec in compare_bam_less order.
+    std::vector<uint32_t> sort_order(const std::vector<bam_record>& brvec) {
+        size_t n = brvec.size();
+        std::vector<uint32_t> order(n);
+        std::vector<run_sort_key> keys(n);
+
+        if (!build_keys(brvec, keys)) {
+            for (size_t i = 0; i < n; i++) {
+                order[i] = i;
+            }
+            std::sort(order.begin(), order.end(),
+                [&brvec](uint32_t a, uint32_t b) {
+                    return compare_bam_less()(brvec[a], brvec[b]);
+                });
+            return order;
+        }
+
+        radix_sort(keys);
+
+        // Records sharing ref, umi, strand and start are ordered by qname,
+        // same as compare_bam_less.
+        size_t i = 0;
+        while (i < n) {
+            size_t j = i + 1;
+            while (j < n && same_key(keys[i], keys[j])) {
+                j++;
+            }
+            if (j - i > 1) {
+                std::sort(keys.begin() + i, keys.begin() + j,
+                    [&brvec](const run_sort_key& a, const run_sort_key& b) {
+                        return strcmp(brvec[a.index].qname,
+                            brvec[b.index].qname) < 0;
+                    });
+            }
+            i = j;
+        }
+
+        for (size_t k = 0; k < n; k++) {
+            order[k] = keys[k].index;
+        }
+        return order;
+    }
+
+    // Packs a UMI into 3 bits per base. The codes of "ACGNT" follow their
+    // ASCII order, so the packed values of equal length UMIs compare like
+    // strcmp. Returns false for any other base or for a too long UMI.
+    static bool pack_umi(const char* umi, size_t umi_len, uint64_t& code) {
+        if (umi_len > max_umi_len) {
+            return false;
+        }
+        code = 0;
+        for (size_t i = 0; i < umi_len; i++) {
+            uint64_t base_code = 0;
+            switch (umi[i]) {
+                case 'A': base_code = 0; break;
+                case 'C': base_code = 1; break;
+                case 'G': base_code = 2; break;
+                case 'N': base_code = 3; break;
+                case 'T': base_code = 4; break;
+                default: return false;
+            }
+            code = (code << 3) | base_code;
+        }
+        return true;
+    }
+
+    private:
+
+    template <typename Func>
+    void parallel_run(unsigned int lthreads, Func func) {
+        std::vector<std::thread> workers;
+        for (unsigned int t = 1; t < lthreads; t++) {
+            workers.emplace_back(func, t);
+        }
+        func(0);
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    unsigned int get_threads(size_t n) {
+        size_t lthreads = n / min_chunk;
+        if (lthreads < 1) {
+            lthreads = 1;
+        }
+        if (lthreads > num_threads) {
+            lthreads = num_threads;
+        }
+        return lthreads;
+    }
+
+    bool build_keys(const std::vector<bam_record>& brvec,
+            std::vector<run_sort_key>& keys) {
+        size_t n = brvec.size();
+        if (n == 0) {
+            return true;
+        }
+        // The packed order only matches strcmp for equal length UMIs.
+        size_t umi_len = strlen(brvec[0].umi);
+        unsigned int lthreads = get_threads(n);
+        std::vector<char> chunk_ok(lthreads, 1);
+
+        parallel_run(lthreads, [&](unsigned int t) {
+            size_t lstart = n * t / lthreads;
+            size_t lend = n * (t + 1) / lthreads;
+            for (size_t i = lstart; i < lend; i++) {
+                const bam_record& lrec = brvec[i];
+                uint64_t umi_code = 0;
+                if (strlen(lrec.umi) != umi_len ||
+                    !pack_umi(lrec.umi, umi_len, umi_code) ||
+                    (lrec.strand != '+' && lrec.strand != '-')) {
+                    chunk_ok[t] = 0;
+                    return;
+                }
+                // '+' sorts before '-' in ASCII.
+                uint64_t strand_bit = (lrec.strand == '-') ? 1 : 0;
+                run_sort_key& lkey = keys[i];
+                lkey.umi_strand = (umi_code << 1) | strand_bit;
+                lkey.pos = lrec.start_pos;
+                // The unmapped tid of -1 has to sort first.
+                lkey.ref = (uint32_t) (lrec.ref_name_id + 1);
+                lkey.index = i;
+            }
+        });
+
+        for (char lok : chunk_ok) {
+            if (!lok) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool same_key(const run_sort_key& a, const run_sort_key& b) {
+        return a.ref == b.ref && a.umi_strand == b.umi_strand &&
+            a.pos == b.pos;
+    }
+
+    enum key_field {POS_FIELD, UMI_FIELD, REF_FIELD};
+
+    struct radix_digit {
+        key_field field;
+        unsigned int shift;
+    };
+
+    static inline uint32_t get_digit(const run_sort_key& lkey,
+            const radix_digit& digit) {
+        uint64_t lval = 0;
+        switch (digit.field) {
+            case POS_FIELD: lval = lkey.pos; break;
+            case UMI_FIELD: lval = lkey.umi_strand; break;
+            case REF_FIELD: lval = lkey.ref; break;
+        }
+        return (lval >> digit.shift) & 0xff;
+    }
+
+    static void add_digits(std::vector<radix_digit>& digits, key_field field,
+            uint64_t or_val, uint64_t and_val, unsigned int nbytes) {
+        // Bytes that are identical over all keys do not need a pass.
+        uint64_t varying = or_val ^ and_val;
+        for (unsigned int b = 0; b < nbytes; b++) {
+            unsigned int shift = 8 * b;
+            if ((varying >> shift) & 0xff) {
+                digits.push_back(radix_digit{field, shift});
+            }
+        }
+    }
+
+    void radix_sort(std::vector<run_sort_key>& keys) {
+        size_t n = keys.size();
+        if (n < 2) {
+            return;
+        }
+
+        uint64_t or_pos = 0, and_pos = ~0ULL;
+        uint64_t or_umi = 0, and_umi = ~0ULL;
+        uint64_t or_ref = 0, and_ref = ~0ULL;
+        for (const run_sort_key& lkey : keys) {
+            or_pos |= lkey.pos;
+            and_pos &= lkey.pos;
+            or_umi |= lkey.umi_strand;
+            and_umi &= lkey.umi_strand;
+            or_ref |= lkey.ref;
+            and_ref &= lkey.ref;
+        }
+
+        // Least significant digit first.
+        std::vector<radix_digit> digits;
+        add_digits(digits, POS_FIELD, or_pos, and_pos, 8);
+        add_digits(digits, UMI_FIELD, or_umi, and_umi, 8);
+        add_digits(digits, REF_FIELD, or_ref, and_ref, 4);
+
+        std::vector<run_sort_key> temp(n);
+        for (const radix_digit& digit : digits) {
+            radix_pass(keys, temp, digit);
+            keys.swap(temp);
+        }
+    }
+
+    // One stable counting sort pass over src into dst. Every thread counts
+    // and then scatters its own contiguous chunk.
+    void radix_pass(const std::vector<run_sort_key>& src,
+            std::vector<run_sort_key>& dst, const radix_digit& digit) {
+        size_t n = src.size();
+        unsigned int lthreads = get_threads(n);
+        std::vector<std::array<size_t, 256>> counts(lthreads);
+
+        parallel_run(lthreads, [&](unsigned int t) {
+            std::array<size_t, 256>& lcount = counts[t];
+            lcount.fill(0);
+            size_t lstart = n * t / lthreads;
+            size_t lend = n * (t + 1) / lthreads;
+            for (size_t i = lstart; i < lend; i++) {
+                lcount[get_digit(src[i], digit)]++;
+            }
+        });
+
+        size_t lsum = 0;
+        for (unsigned int d = 0; d < 256; d++) {
+            for (unsigned int t = 0; t < lthreads; t++) {
+                size_t lc = counts[t][d];
+                counts[t][d] = lsum;
+                lsum += lc;
+            }
+        }
+
+        parallel_run(lthreads, [&](unsigned int t) {
+            std::array<size_t, 256>& loffset = counts[t];
+            size_t lstart = n * t / lthreads;
+            size_t lend = n * (t + 1) / lthreads;
+            for (size_t i = lstart; i < lend; i++) {
+                dst[loffset[get_digit(src[i], digit)]++] = src[i];
+            }
+        });
+    }
+
+    static const size_t max_umi_len = 20;
+    static const size_t min_chunk = 1 << 16;
+    unsigned int num_threads;
+
+};
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef _SCATTER_GATHER_HPP
+#define _SCATTER_GATHER_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <queue>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <experimental/filesystem>
+#include <htslib/sam.h>
+#include "bam_reader.hpp"
+#include "bam_writer.hpp"
+#include "count_matrix.hpp"
+#include "umi_collapser.hpp"
+#include "coordinate_buffer.hpp"
+
+// Clusters never span two UMIs, so a library can be split by UMI into
+// partitions that are collapsed independently:
+//
+//   scatter: the input is streamed once and every read is written to
+//            <outdir>/<prefix>_part<k>.bam, k = hash(UMI) % num_parts
+//   worker:  an ordinary umi_norm run over one partition, with
+//            -i <outdir>/<prefix>_part<k>.bam -o <outdir>/part_<k> -p <prefix>
+//   gather:  the outputs of the workers are concatenated into <outdir>
+//
+// The gathered outputs hold the same reads and clusters as a single run,
+// grouped by partition rather than in one global order. Coordinate sorted
+// _u outputs of workers run with --sort_u are merged by coordinate and
+// indexed instead.
+
+inline std::string get_part_file(const std::string& outdir_str,
+        const std::string& prefix_str, unsigned int part) {
+    return outdir_str + "/" + prefix_str + "_part" + std::to_string(part) + ".bam";
+}
+
+inline std::string get_part_outdir(const std::string& outdir_str,
+        unsigned int part) {
+    return outdir_str + "/part_" + std::to_string(part);
+}
+
+class umi_scatter {
+
+    public:
+
+    umi_scatter(bam_reader& reader, const std::string& outdir_str,
+            const std::string& prefix_str, unsigned int num_parts,
+            size_t umi_len = 6):
+        reader(reader),
+        outdir_str(outdir_str),
+        prefix_str(prefix_str),
+        num_parts(num_parts),
+        umi_len(umi_len) {
+        if (num_parts == 0) {
+            throw std::runtime_error("num_parts has to be positive.");
+        }
+    }
+
+    void run() {
+        std::experimental::filesystem::create_directories(outdir_str);
+        bam_hdr_t* lhdr = reader.get_sam_header();
+        std::vector<std::unique_ptr<bam_writer>> writers;
+        for (unsigned int k = 0; k < num_parts; k++) {
+            std::string part_str = get_part_file(outdir_str, prefix_str, k);
+            writers.emplace_back(new bam_writer(part_str, lhdr));
+        }
+
+        std::vector<unsigned long> part_counts(num_parts, 0);
+        unsigned long read_counter = 0;
+        bam_batch batch(batch_size, umi_len);
+        std::vector<unsigned int> parts(batch.capacity());
+        while (reader.read_batch(batch) > 0) {
+            // Partition the whole batch first, then write it out.
+            for (size_t i = 0; i < batch.size(); i++) {
+                if (!batch.umi_ok[i]) {
+                    std::string err_str = "umi str not found, qname: " +
+                        std::string(bam_get_qname(batch.get_read(i)));
+                    throw std::runtime_error(err_str);
+                }
+                parts[i] = umi_collapser::hash_str(batch.get_umi(i), 0) % num_parts;
+            }
+            for (size_t i = 0; i < batch.size(); i++) {
+                read_counter++;
+                if (read_counter %1000000 == 0) {
+                    std::cout << "The value of read_counter: " << std::to_string(read_counter) << "\n";
+                }
+                writers[parts[i]] -> write_bam(batch.get_read(i));
+                part_counts[parts[i]]++;
+            }
+        }
+
+        std::cout << "Filtered reads: " << std::to_string(reader.get_filtered_count()) << "\n";
+        for (unsigned int k = 0; k < num_parts; k++) {
+            std::cout << "Partition " << k << ": " << part_counts[k] << " reads\n";
+        }
+    }
+
+    private:
+
+    static const size_t batch_size = 4096;
+
+    bam_reader& reader;
+    std::string outdir_str;
+    std::string prefix_str;
+    unsigned int num_parts;
+    size_t umi_len;
+
+};
+
+class umi_gather {
+
+    public:
+
+    umi_gather(const std::string& outdir_str, const std::string& prefix_str,
+            unsigned int num_parts, bool cram_out, const std::string& ref_str,
+            bool compress_text = false):
+        outdir_str(outdir_str),
+        prefix_str(prefix_str),
+        num_parts(num_parts),
+        cram_out(cram_out),
+        ref_str(ref_str),
+        compress_text(compress_text) {
+        if (num_parts == 0) {
+            throw std::runtime_error("num_parts has to be positive.");
+        }
+    }
+
+    void run() {
+        std::string logdir_str = outdir_str + "/logdir";
+        std::experimental::filesystem::create_directories(logdir_str);
+        std::string out_suffix = cram_out ? ".cram" : ".bam";
+
+        std::string u_rel_str = "/" + prefix_str + "_u" + out_suffix;
+        if (count_sorted_parts(u_rel_str) == 0) {
+            concat_bam(u_rel_str);
+        } else {
+            merge_coordinate_bam(u_rel_str);
+        }
+        concat_bam("/logdir/" + prefix_str + "_sorted" + out_suffix);
+        // bgzf files concatenate like the plain ones.
+        std::string text_suffix = compress_text ? ".gz" : "";
+        concat_text("/" + prefix_str + ".bed" + text_suffix);
+        concat_text("/" + prefix_str + "_gap.txt" + text_suffix);
+        concat_text("/logdir/" + prefix_str + "_log.txt" + text_suffix);
+        concat_text("/logdir/" + prefix_str + "_coll_len.txt" + text_suffix);
+
+        count_matrix matrix("");
+        for (unsigned int k = 0; k < num_parts; k++) {
+            matrix.read(get_part_outdir(outdir_str, k) + "/" + prefix_str);
+        }
+        std::string first_u_str = get_part_outdir(outdir_str, 0) + "/" +
+            prefix_str + "_u" + out_suffix;
+        bam_reader first_reader(first_u_str, "", ref_str);
+        matrix.write(outdir_str + "/" + prefix_str, first_reader.get_sam_header());
+    }
+
+    private:
+
+    // Copies the reads of <part_outdir>/<rel_str> of every partition into
+    // <outdir>/<rel_str>.
+    void concat_bam(const std::string& rel_str) {
+        std::string out_str = outdir_str + rel_str;
+        std::unique_ptr<bam_writer> writer;
+        int n_targets = -1;
+        unsigned long read_counter = 0;
+        for (unsigned int k = 0; k < num_parts; k++) {
+            std::string part_str = get_part_outdir(outdir_str, k) + rel_str;
+            bam_reader reader(part_str, "", ref_str);
+            bam_hdr_t* lhdr = reader.get_sam_header();
+            if (!writer) {
+                writer.reset(new bam_writer(out_str, lhdr, "", ref_str));
+                n_targets = lhdr -> n_targets;
+            } else if (lhdr -> n_targets != n_targets) {
+                throw std::runtime_error("Header of " + part_str +
+                    " does not match the other partitions.");
+            }
+            bam1_t* lread = NULL;
+            while ((lread = reader.read_raw()) != NULL) {
+                writer -> write_bam(lread);
+                read_counter++;
+            }
+        }
+        std::cout << "Gathered " << read_counter << " reads into " << out_str << "\n";
+    }
+
+    // Number of partitions whose <rel_str> declares SO:coordinate.
+    unsigned int count_sorted_parts(const std::string& rel_str) {
+        unsigned int lsorted = 0;
+        for (unsigned int k = 0; k < num_parts; k++) {
+            std::string part_str = get_part_outdir(outdir_str, k) + rel_str;
+            bam_reader reader(part_str, "", ref_str);
+            if (coordinate_buffer::is_coordinate_header(reader.get_sam_header())) {
+                lsorted++;
+            }
+        }
+        return lsorted;
+    }
+
+    // Merges the coordinate sorted <rel_str> of every partition into a
+    // coordinate sorted and indexed <outdir>/<rel_str>.
+    void merge_coordinate_bam(const std::string& rel_str) {
+        std::string out_str = outdir_str + rel_str;
+        std::vector<std::unique_ptr<bam_reader>> readers;
+        for (unsigned int k = 0; k < num_parts; k++) {
+            std::string part_str = get_part_outdir(outdir_str, k) + rel_str;
+            readers.emplace_back(new bam_reader(part_str, "", ref_str));
+            bam_hdr_t* lhdr = readers.back() -> get_sam_header();
+            if (!coordinate_buffer::is_coordinate_header(lhdr)) {
+                throw std::runtime_error(part_str + " is not coordinate "
+                    "sorted; all partitions have to be run with or without "
+                    "--sort_u.");
+            }
+            if (lhdr -> n_targets != readers[0] -> get_sam_header() -> n_targets) {
+                throw std::runtime_error("Header of " + part_str +
+                    " does not match the other partitions.");
+            }
+        }
+        bam_writer writer(out_str, readers[0] -> get_sam_header(), "", ref_str);
+        std::string idx_str = writer.init_index(out_str);
+
+        std::vector<const bam1_t*> heads(num_parts, NULL);
+        auto greater = [&heads](unsigned int a, unsigned int b) {
+            return coordinate_buffer::is_less(heads[b], heads[a]);
+        };
+        std::priority_queue<unsigned int, std::vector<unsigned int>,
+            decltype(greater)> part_pq(greater);
+        for (unsigned int k = 0; k < num_parts; k++) {
+            heads[k] = readers[k] -> read_raw();
+            if (heads[k]) {
+                part_pq.push(k);
+            }
+        }
+        unsigned long read_counter = 0;
+        while (!part_pq.empty()) {
+            unsigned int k = part_pq.top();
+            part_pq.pop();
+            writer.write_bam(heads[k]);
+            read_counter++;
+            heads[k] = readers[k] -> read_raw();
+            if (heads[k]) {
+                part_pq.push(k);
+            }
+        }
+        writer.save_index();
+        std::cout << "Merged " << read_counter << " reads by coordinate into " <<
+            out_str << ", index: " << idx_str << "\n";
+    }
+
+    void concat_text(const std::string& rel_str) {
+        std::string out_str = outdir_str + rel_str;
+        std::ofstream out_writer(out_str, std::ios::binary);
+        for (unsigned int k = 0; k < num_parts; k++) {
+            std::string part_str = get_part_outdir(outdir_str, k) + rel_str;
+            std::ifstream part_reader(part_str, std::ios::binary);
+            if (!part_reader.is_open()) {
+                throw std::runtime_error("Could not open: " + part_str);
+            }
+            if (part_reader.peek() != std::ifstream::traits_type::eof()) {
+                out_writer << part_reader.rdbuf();
+            }
+        }
+        std::cout << "Gathered " << out_str << "\n";
+    }
+
+    std::string outdir_str;
+    std::string prefix_str;
+    unsigned int num_parts;
+    bool cram_out;
+    std::string ref_str;
+    bool compress_text;
+
+};
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef _TEXT_SINK_HPP
+#define _TEXT_SINK_HPP
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <htslib/bgzf.h>
+
+// Buffered writer for the text outputs (bed, gap and log files). Lines are
+// formatted straight into a preallocated byte buffer without temporary
+// strings, and the buffer goes to the file in large blocks, either as
+// plain text or, with compress, as BGZF (readable by zcat and bgzip).
+class text_sink {
+
+    public:
+
+    text_sink(const std::string& outfile_str, bool compress = false,
+            size_t buffer_bytes = 1 << 20):
+        outfile_str(outfile_str),
+        buffer(buffer_bytes < min_buffer_bytes ? min_buffer_bytes : buffer_bytes) {
+        if (compress) {
+            bgzf_fp = bgzf_open(outfile_str.c_str(), "w");
+            if (!bgzf_fp) {
+                throw std::runtime_error("Could not open: " + outfile_str);
+            }
+        } else {
+            fp = fopen(outfile_str.c_str(), "wb");
+            if (!fp) {
+                throw std::runtime_error("Could not open: " + outfile_str);
+            }
+            // The buffer here is already large; skip the one of stdio.
+            setvbuf(fp, NULL, _IONBF, 0);
+        }
+    }
+
+    text_sink(const text_sink&) = delete;
+    text_sink& operator=(const text_sink&) = delete;
+
+    ~text_sink() {
+        try {
+            close();
+        } catch (const std::exception& e) {
+            fprintf(stderr, "%s\n", e.what());
+        }
+    }
+
+    text_sink& put(char c) {
+        reserve(1);
+        buffer[used++] = c;
+        return *this;
+    }
+
+    text_sink& put(const char* str, size_t len) {
+        if (len > buffer.size()) {
+            flush();
+            write_block(str, len);
+            return *this;
+        }
+        reserve(len);
+        memcpy(&buffer[used], str, len);
+        used += len;
+        return *this;
+    }
+
+    text_sink& put(const char* str) {
+        return put(str, strlen(str));
+    }
+
+    text_sink& put(const std::string& str) {
+        return put(str.data(), str.size());
+    }
+
+    text_sink& put_uint(unsigned long val) {
+        // Digits are written back to front into a scratch area.
+        char ldigits[20];
+        int lpos = 20;
+        do {
+            ldigits[--lpos] = '0' + (val % 10);
+            val /= 10;
+        } while (val);
+        return put(ldigits + lpos, 20 - lpos);
+    }
+
+    text_sink& put_int(long val) {
+        if (val < 0) {
+            put('-');
+            return put_uint(0UL - (unsigned long) val);
+        }
+        return put_uint(val);
+    }
+
+    void flush() {
+        if (used > 0) {
+            write_block(buffer.data(), used);
+            used = 0;
+        }
+    }
+
+    void close() {
+        if (!fp && !bgzf_fp) {
+            return;
+        }
+        flush();
+        if (fp) {
+            int ret = fclose(fp);
+            fp = NULL;
+            if (ret != 0) {
+                throw std::runtime_error("Error while closing: " + outfile_str);
+            }
+        }
+        if (bgzf_fp) {
+            int ret = bgzf_close(bgzf_fp);
+            bgzf_fp = NULL;
+            if (ret != 0) {
+                throw std::runtime_error("Error while closing: " + outfile_str);
+            }
+        }
+    }
+
+    private:
+
+    void reserve(size_t len) {
+        if (used + len > buffer.size()) {
+            flush();
+        }
+    }
+
+    void write_block(const char* data, size_t len) {
+        if (bgzf_fp) {
+            if (bgzf_write(bgzf_fp, data, len) != (ssize_t) len) {
+                throw std::runtime_error("Error while writing: " + outfile_str);
+            }
+        } else if (fwrite(data, 1, len, fp) != len) {
+            throw std::runtime_error("Error while writing: " + outfile_str);
+        }
+    }
+
+    static const size_t min_buffer_bytes = 64;
+
+    std::string outfile_str;
+    FILE* fp = NULL;
+    BGZF* bgzf_fp = NULL;
+    std::vector<char> buffer;
+    size_t used = 0;
+
+};
+
+#endif
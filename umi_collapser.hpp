@@ -0,0 +1,287 @@
+#ifndef _UMI_COLLAPSER_HPP
+#define _UMI_COLLAPSER_HPP
+
+#include <cstdint>
+#include <string>
+#include <random>
+#include <functional>
+#include <stdexcept>
+#include "bam_record.hpp"
+#include "cluster_buffer.hpp"
+#include "collapse_policy.hpp"
+
+// Called once for every finished cluster, with the position of the read
+// that was chosen to represent it.
+typedef std::function<void(cluster_buffer&, int)> cluster_callback;
+
+// Segments a stream of reads in compare_bam_less order into UMI clusters.
+// Reads are fed one at a time with add_record; whenever a read breaks the
+// current cluster, the cluster is handed to the callback and a new one is
+// started. Where a cluster breaks is decided per reference by the
+// collapse_policy (see collapse_policy.hpp).
+//
+// The representative of a cluster is chosen by rep_policy:
+//   hash:    position given by a hash of the cluster identity (ref, UMI,
+//            strand, start) and the seed
+//   mapq:    read with the highest mapping quality
+//   longest: read with the longest alignment on the reference
+//   random:  position drawn from one random engine shared by all clusters
+// Ties of mapq and longest are broken by a hash of the qname. All policies
+// but random only depend on the cluster itself, so the choice does not
+// change however the clusters are split across threads or processes.
+//
+// The break check is specialized at compile time on the collapse mode
+// (feature, coordinate, or per reference when the policy mixes them) and
+// on the UMI width (6, 8, 10 or 12 bases; 0 is any width), and the
+// constructor picks the specialization once.
+class umi_collapser {
+
+    public:
+
+    // One mode and gap for all references.
+    umi_collapser(const std::string& coll_str, int brake_gap,
+            const std::string& spill_str, unsigned long mem_lim,
+            cluster_callback callback, const std::string& rep_policy = "hash",
+            unsigned seed = 100):
+        umi_collapser(collapse_policy(coll_str, brake_gap), spill_str,
+            mem_lim, callback, rep_policy, seed) {
+    }
+
+    // With umi_len > 0 every UMI has to have exactly umi_len bases.
+    umi_collapser(const collapse_policy& coll_policy,
+            const std::string& spill_str, unsigned long mem_lim,
+            cluster_callback callback, const std::string& rep_policy = "hash",
+            unsigned seed = 100, size_t umi_len = 0):
+        coll_policy(coll_policy),
+        local_vec(spill_str, mem_lim),
+        callback(callback),
+        seed(seed),
+        generator(seed) {
+        if (rep_policy == "hash") {
+            policy = HASH_POLICY;
+        } else if (rep_policy == "mapq") {
+            policy = MAPQ_POLICY;
+        } else if (rep_policy == "longest") {
+            policy = LONGEST_POLICY;
+        } else if (rep_policy == "random") {
+            policy = RANDOM_POLICY;
+        } else {
+            std::string throw_msg = "Illegal representative policy: " + rep_policy;
+            throw std::runtime_error(throw_msg);
+        }
+        if (!coll_policy.uses_mode(COORDINATE_COLLAPSE)) {
+            add_fn = select_width<feature_break>(umi_len);
+        } else if (!coll_policy.uses_mode(FEATURE_COLLAPSE)) {
+            add_fn = select_width<coordinate_break>(umi_len);
+        } else {
+            add_fn = select_width<mixed_break>(umi_len);
+        }
+    }
+
+    void add_record(const bam_record& lrec) {
+        (this ->* add_fn)(lrec);
+    }
+
+    // 64 bit finalizer of splitmix64.
+    static uint64_t mix_hash(uint64_t lval) {
+        lval += 0x9e3779b97f4a7c15ULL;
+        lval = (lval ^ (lval >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        lval = (lval ^ (lval >> 27)) * 0x94d049bb133111ebULL;
+        return lval ^ (lval >> 31);
+    }
+
+    static uint64_t hash_str(const char* lstr, uint64_t lhash) {
+        // FNV-1a
+        lhash ^= 0xcbf29ce484222325ULL;
+        for (; *lstr; lstr++) {
+            lhash ^= (unsigned char) *lstr;
+            lhash *= 0x100000001b3ULL;
+        }
+        return mix_hash(lhash);
+    }
+
+    // Hash of the identity of the cluster starting with first_rec.
+    static uint64_t cluster_hash(const bam_record& first_rec, uint64_t lseed) {
+        uint64_t lhash = mix_hash(lseed ^ (uint64_t)(uint32_t) first_rec.ref_name_id);
+        lhash = hash_str(first_rec.umi, lhash);
+        lhash = mix_hash(lhash ^ (unsigned char) first_rec.strand);
+        return mix_hash(lhash ^ first_rec.start_pos);
+    }
+
+    // Flushes the last cluster.
+    void finish() {
+        if (!local_vec.empty()) {
+            close_cluster();
+        }
+    }
+
+    template <size_t UMI_LEN = 0>
+    static bool will_break_coordinate(const bam_record& last_rec,
+            const bam_record& this_rec, int brake_gap) {
+        // Compare between last_rec and this_rec; in some cases first rec and
+        // last_rec would be identical.
+        if (last_rec.ref_name_id != this_rec.ref_name_id) {
+            return true;
+        } else if (0 != compare_umi<UMI_LEN>(last_rec.umi, this_rec.umi)) {
+            return true;
+        } else if (last_rec.strand != this_rec.strand) {
+            return true;
+        } else if ((this_rec.start_pos - last_rec.start_pos) >
+            (unsigned long) brake_gap) {
+            return true;
+        } else {
+            return false;
+        }
+    }
+
+    // True if both reads have the same ref, UMI and strand.
+    template <size_t UMI_LEN = 0>
+    static bool is_same_group(const bam_record& last_rec,
+            const bam_record& this_rec) {
+        if (last_rec.ref_name_id != this_rec.ref_name_id) {
+            return false;
+        } else if (0 != compare_umi<UMI_LEN>(last_rec.umi, this_rec.umi)) {
+            return false;
+        } else if (last_rec.strand != this_rec.strand) {
+            return false;
+        } else {
+            return true;
+        }
+    }
+
+    template <size_t UMI_LEN = 0>
+    static bool will_break_feature(const bam_record& last_rec,
+            const bam_record& this_rec) {
+        return !is_same_group<UMI_LEN>(last_rec, this_rec);
+    }
+
+    // lref is the collapse of the reference of this_record.
+    template <size_t UMI_LEN = 0>
+    static bool will_break(const bam_record& last_record,
+            const bam_record& this_record, const ref_collapse& lref) {
+        if (lref.mode == FEATURE_COLLAPSE) {
+            return will_break_feature<UMI_LEN>(last_record, this_record);
+        } else {
+            return will_break_coordinate<UMI_LEN>(last_record, this_record,
+                lref.brake_gap);
+        }
+    }
+
+    private:
+
+    // Break policies of add_record_impl
+    struct feature_break {
+        template <size_t UMI_LEN>
+        static bool will_break(const collapse_policy&,
+                const bam_record& last_rec, const bam_record& this_rec) {
+            return will_break_feature<UMI_LEN>(last_rec, this_rec);
+        }
+    };
+
+    // The gap is only looked up within a group, where the reference is
+    // known to be the same.
+    struct coordinate_break {
+        template <size_t UMI_LEN>
+        static bool will_break(const collapse_policy& coll_policy,
+                const bam_record& last_rec, const bam_record& this_rec) {
+            return !is_same_group<UMI_LEN>(last_rec, this_rec) ||
+                (this_rec.start_pos - last_rec.start_pos) >
+                    (unsigned long) coll_policy.get(this_rec.ref_name_id).brake_gap;
+        }
+    };
+
+    struct mixed_break {
+        template <size_t UMI_LEN>
+        static bool will_break(const collapse_policy& coll_policy,
+                const bam_record& last_rec, const bam_record& this_rec) {
+            return umi_collapser::will_break<UMI_LEN>(last_rec, this_rec,
+                coll_policy.get(this_rec.ref_name_id));
+        }
+    };
+
+    typedef void (umi_collapser::*add_function)(const bam_record&);
+
+    template <class BREAK, size_t UMI_LEN>
+    void add_record_impl(const bam_record& lrec) {
+        if (!local_vec.empty() && BREAK::template will_break<UMI_LEN>(
+            coll_policy, local_vec.back(), lrec)) {
+            close_cluster();
+        }
+        if (policy == MAPQ_POLICY || policy == LONGEST_POLICY) {
+            update_best(lrec);
+        }
+        local_vec.push_back(lrec);
+    }
+
+    template <class BREAK>
+    static add_function select_width(size_t umi_len) {
+        switch (umi_len) {
+            case 6:
+                return &umi_collapser::add_record_impl<BREAK, 6>;
+            case 8:
+                return &umi_collapser::add_record_impl<BREAK, 8>;
+            case 10:
+                return &umi_collapser::add_record_impl<BREAK, 10>;
+            case 12:
+                return &umi_collapser::add_record_impl<BREAK, 12>;
+            default:
+                return &umi_collapser::add_record_impl<BREAK, 0>;
+        }
+    }
+
+    enum rep_policy_t {HASH_POLICY, MAPQ_POLICY, LONGEST_POLICY, RANDOM_POLICY};
+
+    void update_best(const bam_record& lrec) {
+        unsigned int lscore = (policy == MAPQ_POLICY) ? lrec.mapq : lrec.aln_len;
+        uint64_t lhash = hash_str(lrec.qname, seed);
+        if (local_vec.empty() || lscore > best_score ||
+            (lscore == best_score && lhash < best_hash)) {
+            best_pos = local_vec.size();
+            best_score = lscore;
+            best_hash = lhash;
+        }
+    }
+
+    int get_rep_pos() {
+        switch (policy) {
+            case HASH_POLICY:
+                return cluster_hash(local_vec.front(), seed) % local_vec.size();
+            case MAPQ_POLICY:
+            case LONGEST_POLICY:
+                return best_pos;
+            case RANDOM_POLICY:
+            default:
+                return get_rand_pos(local_vec.size());
+        }
+    }
+
+    void close_cluster() {
+        int rand_pos = get_rep_pos();
+        callback(local_vec, rand_pos);
+        local_vec.clear();
+    }
+
+    int get_rand_pos(int vec_size) {
+        if (vec_size == 1) {
+            return 0;
+        } else {
+            int vec_size_t = vec_size - 1;
+            std::uniform_int_distribution<int> distribution(0, vec_size_t);
+            return distribution(generator);
+        }
+    }
+
+    collapse_policy coll_policy;
+    add_function add_fn = NULL;
+    cluster_buffer local_vec;
+    cluster_callback callback;
+    rep_policy_t policy = HASH_POLICY;
+    unsigned seed;
+    std::default_random_engine generator;
+    size_t best_pos = 0;
+    unsigned int best_score = 0;
+    uint64_t best_hash = 0;
+
+};
+
+#endif
@@ -0,0 +1,832 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <queue>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <limits>
+#include <thread>
+#include <exception>
+#include <experimental/filesystem>
+
+namespace fs = std::experimental::filesystem;
+
+#include "umi_norm_lib.hpp"
+#include "bam_reader.hpp"
+#include "bam_writer.hpp"
+#include "run_prefetcher.hpp"
+#include "run_sorter.hpp"
+
+umi_norm_engine::umi_norm_engine(const umi_norm_config& config,
+    bam_hdr_t* lhdr)
+    : config(config),
+    lhdr(lhdr),
+    coll_policy(config.coll_str, config.brake_gap, config.ref_rules) {
+        if (this -> config.num_threads == 0) {
+            this -> config.num_threads = 1;
+        }
+        // The runs are decoded again from their qnames.
+        if (this -> config.umi_len == 0) {
+            throw std::runtime_error("The UMI length has to be positive.");
+        }
+        coll_policy.resolve(lhdr);
+        if (coll_policy.has_rules()) {
+            coll_policy.print();
+        }
+        if (this -> config.stream_coordinate &&
+            coll_policy.uses_mode(FEATURE_COLLAPSE)) {
+            throw std::runtime_error("Streaming needs the coordinate collapse.");
+        }
+        // The stream closes clusters after brake_gap, too early for any
+        // longer sweep gap.
+        if (this -> config.stream_coordinate && !this -> config.sweep_gaps.empty()) {
+            throw std::runtime_error("A gap sweep can not be streamed.");
+        }
+        // A sweep gap only changes the clusters of coordinate references
+        // without a gap of their own.
+        if (!this -> config.sweep_gaps.empty()) {
+            if (!coll_policy.uses_mode(COORDINATE_COLLAPSE)) {
+                throw std::runtime_error("A gap sweep needs the coordinate "
+                    "collapse for some reference.");
+            }
+            if (!coll_policy.uses_default_gap()) {
+                std::cout << "Warning: every coordinate reference has a gap "
+                    "of its own in --ref_collapse; the sweep outputs will be "
+                    "the same as the main output.\n";
+            }
+        }
+        for (int lgap : this -> config.sweep_gaps) {
+            sweep_policies.emplace_back(config.coll_str, lgap, config.ref_rules);
+            sweep_policies.back().resolve(lhdr);
+        }
+        if (this -> config.reserved_cluster_mem >= this -> config.size_lim / 2) {
+            throw std::runtime_error("The reserved cluster memory has to be "
+                "less than half of the memory budget.");
+        }
+        if (this -> config.presorted && (this -> config.stream_coordinate ||
+            !this -> config.previous_sorted.empty())) {
+            throw std::runtime_error("Presorted input can neither be streamed "
+                "by coordinate nor merged with a previous sorted bam.");
+        }
+        if (!this -> config.previous_sorted.empty()) {
+            if (this -> config.stream_coordinate) {
+                throw std::runtime_error("A previous sorted bam can not be "
+                    "merged while streaming.");
+            }
+            check_previous_header();
+            // Last, so that no exception leaves the thread running.
+            if (this -> config.merge_parts > 1 && can_seek_previous()) {
+                previous_sampler = std::thread([this]() {
+                    try {
+                        sample_previous();
+                    } catch (...) {
+                        previous_error = std::current_exception();
+                    }
+                });
+            }
+        }
+    }
+
+// The previous reads carry the tids of their own header, so the references
+// have to be the same and in the same order.
+void umi_norm_engine::check_previous_header() {
+    std::string previous_str = config.previous_sorted;
+    bam_reader reader(previous_str, "", config.ref_str);
+    bam_hdr_t* prev_hdr = reader.get_sam_header();
+    if (prev_hdr -> n_targets != lhdr -> n_targets) {
+        throw std::runtime_error("The references of " + previous_str +
+            " do not match the input: " + std::to_string(prev_hdr -> n_targets) +
+            " instead of " + std::to_string(lhdr -> n_targets));
+    }
+    for (int tid = 0; tid < lhdr -> n_targets; tid++) {
+        if (strcmp(prev_hdr -> target_name[tid], lhdr -> target_name[tid]) != 0 ||
+            prev_hdr -> target_len[tid] != lhdr -> target_len[tid]) {
+            throw std::runtime_error("The references of " + previous_str +
+                " do not match the input at: " +
+                std::string(lhdr -> target_name[tid]));
+        }
+    }
+}
+
+// The ranges of a parallel merge seek into the runs; a previous sorted
+// cram can not.
+bool umi_norm_engine::can_seek_previous() {
+    const std::string bam_suffix = ".bam";
+    const std::string& prev_str = config.previous_sorted;
+    return prev_str.size() >= bam_suffix.size() &&
+        prev_str.compare(prev_str.size() - bam_suffix.size(),
+            bam_suffix.size(), bam_suffix) == 0;
+}
+
+// Keeps every sample_interval-th key of the previous sorted bam with its
+// offset, as write_run_record does for the runs written here, so that the
+// splitters of a parallel merge are balanced over its reads too and
+// located in it without a scan from its start. It reads the file once,
+// alongside the split phase.
+void umi_norm_engine::sample_previous() {
+    std::string previous_str = config.previous_sorted;
+    bam_reader reader(previous_str, "", config.ref_str);
+    run_sample lkey;
+    unsigned long lindex = 0;
+    while (true) {
+        long lcur = reader.get_virtual_offset();
+        bam1_t* lread = reader.read_raw();
+        if (!lread) {
+            break;
+        }
+        if (lindex++ % sample_interval == 0) {
+            get_raw_key(lread, config.umi_len, lkey);
+            lkey.voffset = lcur;
+            previous_samples.push_back(lkey);
+        }
+    }
+}
+
+void umi_norm_engine::join_previous_sampler() {
+    if (!previous_sampler.joinable()) {
+        return;
+    }
+    previous_sampler.join();
+    if (previous_error) {
+        std::rethrow_exception(previous_error);
+    }
+    std::cout << "Samples of the previous sorted reads: " <<
+        previous_samples.size() << "\n";
+    run_samples[0] = std::move(previous_samples);
+}
+
+umi_norm_engine::~umi_norm_engine() {
+    clean();
+}
+
+void umi_norm_engine::set_cluster_callback(cluster_callback callback) {
+    cluster_cb = callback;
+}
+
+void umi_norm_engine::set_record_callback(record_callback callback) {
+    record_cb = callback;
+}
+
+void umi_norm_engine::set_gap_callback(gap_callback callback) {
+    gap_cb = callback;
+}
+
+void umi_norm_engine::set_sweep_callback(sweep_callback callback) {
+    sweep_cb = callback;
+}
+
+void umi_norm_engine::set_part_factory(part_factory factory) {
+    this -> factory = factory;
+}
+
+unsigned int umi_norm_engine::get_num_parts() const {
+    return parts.size();
+}
+
+// Builds the collapse state of the key ranges, after the callbacks are
+// set.
+void umi_norm_engine::open_parts(unsigned int num_parts) {
+    if (!parts.empty()) {
+        return;
+    }
+    for (unsigned int p = 0; p < num_parts; p++) {
+        std::unique_ptr<merge_part> lpart(new merge_part());
+        if (factory) {
+            lpart -> callbacks = factory(p);
+        } else {
+            lpart -> callbacks.record_cb = record_cb;
+            lpart -> callbacks.gap_cb = gap_cb;
+            lpart -> callbacks.cluster_cb = cluster_cb;
+            lpart -> callbacks.sweep_cb = sweep_cb;
+        }
+        parts.push_back(std::move(lpart));
+    }
+}
+
+// The collapser of a range is built on first use, so that single pass runs
+// only create the spill file they need.
+umi_collapser& umi_norm_engine::get_collapser(unsigned int part) {
+    merge_part& lpart = *parts[part];
+    if (!lpart.collapser) {
+        std::string spill_prefix = config.temp_prefix + "_cluster_spill" +
+            (part > 0 ? "_" + std::to_string(part) : "");
+        // The cluster memory is shared by the ranges and the gaps.
+        unsigned long mem_lim = get_cluster_mem_bytes() / parts.size() /
+            (1 + sweep_policies.size());
+        lpart.collapser.reset(new umi_collapser(coll_policy, spill_prefix + ".txt",
+            mem_lim, lpart.callbacks.cluster_cb, config.rep_policy, config.seed,
+            config.umi_len));
+        for (unsigned int j = 0; j < sweep_policies.size(); j++) {
+            sweep_callback lsweep_cb = lpart.callbacks.sweep_cb;
+            cluster_callback lcluster_cb = [lsweep_cb, j](cluster_buffer& local_vec,
+                int rep_pos) {
+                if (lsweep_cb) {
+                    lsweep_cb(j, local_vec, rep_pos);
+                }
+            };
+            lpart.sweep_collapsers.emplace_back(new umi_collapser(
+                sweep_policies[j], spill_prefix + "_gap" +
+                std::to_string(config.sweep_gaps[j]) + ".txt", mem_lim,
+                lcluster_cb, config.rep_policy, config.seed, config.umi_len));
+        }
+    }
+    return *lpart.collapser;
+}
+
+// Hands one read of the sorted order to the collapser and the callbacks.
+// The collapser goes first, so that a cluster ended by this read is
+// reported before the read itself reaches the record callback.
+void umi_norm_engine::emit_sorted(merge_part& lpart, const bam_record& lrec) {
+    lpart.mapped_count++;
+    lpart.collapser -> add_record(lrec);
+    for (std::unique_ptr<umi_collapser>& lsweep : lpart.sweep_collapsers) {
+        lsweep -> add_record(lrec);
+    }
+    if (lpart.callbacks.record_cb) {
+        lpart.callbacks.record_cb(lrec);
+    }
+    if (lpart.callbacks.gap_cb) {
+        if (lpart.has_prev && umi_collapser::is_same_group(lpart.prev_rec, lrec)) {
+            lpart.callbacks.gap_cb(lpart.prev_rec, lrec);
+        }
+        lpart.prev_rec = lrec;
+        lpart.has_prev = true;
+    }
+}
+
+void umi_norm_engine::finish_parts() {
+    unsigned long lcount = 0;
+    for (unsigned int p = 0; p < parts.size(); p++) {
+        get_collapser(p).finish();
+        for (std::unique_ptr<umi_collapser>& lsweep : parts[p] -> sweep_collapsers) {
+            lsweep -> finish();
+        }
+        lcount += parts[p] -> mapped_count;
+    }
+    std::cout << "mapped_count: " << lcount << "\n";
+}
+
+// Runs body(p) for every range on a thread of its own; the first error is
+// rethrown once all threads are done.
+void umi_norm_engine::run_parts(std::function<void(unsigned int)> body) {
+    if (parts.size() == 1) {
+        body(0);
+        return;
+    }
+    std::vector<std::exception_ptr> errors(parts.size());
+    std::vector<std::thread> threads;
+    for (unsigned int p = 0; p < parts.size(); p++) {
+        threads.emplace_back([&body, &errors, p]() {
+            try {
+                body(p);
+            } catch (...) {
+                errors[p] = std::current_exception();
+            }
+        });
+    }
+    for (std::thread& lthread : threads) {
+        lthread.join();
+    }
+    for (std::exception_ptr& lerror : errors) {
+        if (lerror) {
+            std::rethrow_exception(lerror);
+        }
+    }
+}
+
+std::string umi_norm_engine::get_temp_file(unsigned int count) {
+
+    std::string res = config.temp_prefix + "_" + std::to_string(count) + ".bam";
+    return res;
+}
+
+// Run 0 is the previous sorted bam; the others are temporary files.
+std::string umi_norm_engine::get_run_file(unsigned int run_id) {
+    if (run_id == 0) {
+        return config.previous_sorted;
+    }
+    return get_temp_file(run_id);
+}
+
+// Reference to decode a run with; only the previous sorted file may be a
+// cram.
+std::string umi_norm_engine::get_run_ref(unsigned int run_id) {
+    return run_id == 0 ? config.ref_str : "";
+}
+
+// The runs written here hold filtered reads already.
+const read_filter* umi_norm_engine::get_run_filter(unsigned int run_id) {
+    return run_id == 0 ? config.previous_filter : NULL;
+}
+
+void umi_norm_engine::add_record(const bam1_t* lread) {
+    bam_record lrec;
+    bam_reader::decode_record(lhdr, lread, lrec, config.umi_len);
+    add_record(std::move(lrec));
+}
+
+void umi_norm_engine::add_record(bam_record&& lrec) {
+    if (finished) {
+        throw std::runtime_error("add_record called after finish.");
+    }
+    read_counter++;
+    if (!lrec.is_mapped) {
+        return;
+    }
+    // The specialized comparisons read exactly umi_len bytes of every UMI.
+    if (strlen(lrec.umi) != config.umi_len) {
+        throw std::runtime_error("UMI of " + std::to_string(config.umi_len) +
+            " bases expected, qname: " + std::string(lrec.qname));
+    }
+    if (config.stream_coordinate) {
+        if (!stream) {
+            open_parts(1);
+            stream.reset(new coordinate_stream(coll_policy,
+                get_collapser(0), parts[0] -> callbacks.gap_cb));
+        }
+        stream -> add_record(lrec);
+        return;
+    }
+    if (config.presorted) {
+        add_presorted(std::move(lrec));
+        return;
+    }
+    used_size += lrec.get_size();
+    brvec.push_back(std::move(lrec));
+    if (used_size > config.size_lim) {
+        dump_run();
+    }
+}
+
+// Presorted reads are collapsed as they arrive; the order is checked
+// against the previous read, as the merge checks its runs.
+void umi_norm_engine::add_presorted(bam_record&& lrec) {
+    if (!has_presorted) {
+        open_parts(1);
+        get_collapser(0);
+    } else if (compare_bam_less()(lrec, last_presorted)) {
+        throw std::runtime_error("Input is not in the order of a sorted "
+            "bam at qname: " + std::string(lrec.qname));
+    }
+    emit_sorted(*parts[0], lrec);
+    last_presorted = std::move(lrec);
+    has_presorted = true;
+}
+
+void umi_norm_engine::dump_run() {
+    last_run_id++;
+    dump_sorted_records(brvec, last_run_id);
+    run_ids.push_back(last_run_id);
+    std::cout << "split_count: " << std::to_string(run_ids.size()) << "\n";
+    brvec.clear();
+    used_size = 0;
+}
+
+void umi_norm_engine::dump_sorted_records (std::vector<bam_record>& brvec,
+        unsigned int temp_count) {
+    // Only the (key, index) pairs are sorted; the records themselves stay
+    // in place and are picked up in sorted order while writing.
+    run_sorter sorter(config.num_threads);
+    std::vector<uint32_t> order = sorter.sort_order(brvec);
+    std::string temp_str = get_temp_file(temp_count);
+    bam_writer writer(temp_str, lhdr);
+    std::cout << "Dumping data to file: " << temp_str << "\n";
+    std::cout << "Vector size: " << brvec.size() << "\n";
+    for (size_t j = 0; j < order.size(); j++) {
+        write_run_record(writer, temp_count, brvec[order[j]], j);
+    }
+}
+
+// Writes the index-th read of a run, keeping every sample_interval-th key
+// with its offset for the splitters of the parallel merge.
+void umi_norm_engine::write_run_record(bam_writer& writer, unsigned int run_id,
+        const bam_record& lrec, unsigned long index) {
+    if (index % sample_interval == 0) {
+        long voffset = writer.get_virtual_offset();
+        if (voffset >= 0) {
+            run_samples[run_id].push_back(run_sample{lrec.ref_name_id,
+                lrec.umi, lrec.strand, voffset});
+        }
+    }
+    writer.write_record(lrec.full_rec);
+}
+
+// During the final merge half of the memory budget is used as read-ahead
+// for the runs and the other half holds the cluster being built; the
+// intermediate merges give all of it to the read-ahead.
+unsigned long umi_norm_engine::get_readahead_bytes(size_t num_runs,
+        unsigned long budget) {
+    if (num_runs == 0) {
+        return budget;
+    }
+    return budget / num_runs;
+}
+
+unsigned long umi_norm_engine::get_cluster_mem_bytes() {
+    return config.size_lim / 2 - config.reserved_cluster_mem;
+}
+
+void umi_norm_engine::finish() {
+    if (finished) {
+        return;
+    }
+    finished = true;
+    std::cout << "Total reads added: " << std::to_string(read_counter) << "\n";
+
+    if (config.stream_coordinate || config.presorted) {
+        open_parts(1);
+        if (stream) {
+            stream -> finish();
+        }
+        finish_parts();
+    } else if (run_ids.empty() && config.previous_sorted.empty()) {
+        // Everything fit into the budget; no run has to touch the disk.
+        collapse_in_memory();
+    } else {
+        if (!brvec.empty()) {
+            dump_run();
+        }
+        if (!config.previous_sorted.empty()) {
+            std::cout << "Merging previous sorted reads: " <<
+                config.previous_sorted << "\n";
+            join_previous_sampler();
+            run_ids.insert(run_ids.begin(), 0);
+        }
+        brvec.clear();
+        used_size = 0;
+        std::cout << "Reached end of split and sort" << "\n";
+        reduce_runs();
+        merge_files();
+    }
+    clean();
+}
+
+void umi_norm_engine::collapse_in_memory() {
+    run_sorter sorter(config.num_threads);
+    std::vector<uint32_t> order = sorter.sort_order(brvec);
+
+    // The sorted order is cut into ranges at ref/UMI/strand boundaries.
+    unsigned int num_parts = std::max(1U, std::min(get_merge_parts(),
+        (unsigned int) (order.size() / (size_t) min_part_reads)));
+    std::vector<size_t> bounds(1, 0);
+    for (unsigned int p = 1; p < num_parts; p++) {
+        size_t lbound = std::max(bounds.back(), order.size() * p / num_parts);
+        while (lbound > bounds.back() && lbound < order.size() &&
+            umi_collapser::is_same_group(brvec[order[lbound - 1]],
+                brvec[order[lbound]])) {
+            lbound++;
+        }
+        if (lbound > bounds.back() && lbound < order.size()) {
+            bounds.push_back(lbound);
+        }
+    }
+    bounds.push_back(order.size());
+
+    open_parts(bounds.size() - 1);
+    run_parts([&](unsigned int p) {
+        merge_part& lpart = *parts[p];
+        get_collapser(p);
+        for (size_t j = bounds[p]; j < bounds[p + 1]; j++) {
+            emit_sorted(lpart, brvec[order[j]]);
+        }
+    });
+    finish_parts();
+    brvec.clear();
+    used_size = 0;
+}
+
+// K-way merge of the run ranges in compare_bam_less order; every read is
+// passed to sink. The heap comparison is picked once by the UMI length.
+void umi_norm_engine::merge_runs(const std::vector<run_range>& ranges,
+        unsigned long readahead_bytes, record_callback sink) {
+    switch (config.umi_len) {
+        case 6:
+            merge_runs_fixed<6>(ranges, readahead_bytes, sink);
+            break;
+        case 8:
+            merge_runs_fixed<8>(ranges, readahead_bytes, sink);
+            break;
+        case 10:
+            merge_runs_fixed<10>(ranges, readahead_bytes, sink);
+            break;
+        case 12:
+            merge_runs_fixed<12>(ranges, readahead_bytes, sink);
+            break;
+        default:
+            merge_runs_fixed<0>(ranges, readahead_bytes, sink);
+            break;
+    }
+}
+
+template <size_t UMI_LEN>
+void umi_norm_engine::merge_runs_fixed(const std::vector<run_range>& ranges,
+        unsigned long readahead_bytes, record_callback& sink) {
+
+    std::map<unsigned int, std::unique_ptr<run_prefetcher>> reader_map;
+    std::priority_queue<bam_record, std::vector<bam_record>,
+        compare_bam_greater_fixed<UMI_LEN>> bam_pq;
+    compare_bam_less_fixed<UMI_LEN> less;
+
+    for (const run_range& lrange : ranges) {
+        unsigned int j = lrange.run_id;
+        std::string temp_str = get_run_file(j);
+        reader_map[j].reset(new run_prefetcher(temp_str, readahead_bytes,
+            lrange.start_offset, lrange.end_offset, config.umi_len,
+            get_run_ref(j), get_run_filter(j)));
+        // Get the first read; it is expected that the first read would
+        // be useful.
+        bam_record lrec;
+        if (reader_map[j]->read_record(lrec)) {
+            lrec.reader_index = j;
+            bam_pq.push(std::move(lrec));
+        }
+    }
+
+    while(!bam_pq.empty()) {
+        const bam_record& lrec = bam_pq.top();
+        sink(lrec);
+        unsigned int reader_index = lrec.reader_index;
+        // get the index of the lrec and get one from that reader
+        bam_record lrec_new;
+        bool has_new = reader_map[reader_index]->read_record(lrec_new);
+        // A run out of order (e.g. a previous sorted bam that was
+        // modified) would silently split clusters.
+        if (has_new && less(lrec_new, lrec)) {
+            throw std::runtime_error("Run is not sorted: " +
+                get_run_file(reader_index) + " at qname: " +
+                std::string(lrec_new.qname));
+        }
+        bam_pq.pop();
+        if (has_new) {
+            // transfer the reader_index
+            lrec_new.reader_index = reader_index;
+            bam_pq.push(std::move(lrec_new));
+        }
+    }
+}
+
+// Merges groups of max_fan_in runs into longer runs until the final merge
+// can open all of them at once.
+void umi_norm_engine::reduce_runs() {
+    unsigned int fan_in = config.max_fan_in;
+    if (fan_in < 2) {
+        return;
+    }
+    unsigned int merge_pass = 0;
+    while (run_ids.size() > fan_in) {
+        merge_pass++;
+        std::vector<unsigned int> next_ids;
+        for (size_t lstart = 0; lstart < run_ids.size(); lstart += fan_in) {
+            size_t lend = std::min(run_ids.size(), lstart + fan_in);
+            std::vector<unsigned int> group(run_ids.begin() + lstart,
+                run_ids.begin() + lend);
+            if (group.size() == 1) {
+                next_ids.push_back(group[0]);
+                continue;
+            }
+            last_run_id++;
+            unsigned int merged_id = last_run_id;
+            std::string temp_str = get_temp_file(merged_id);
+            std::cout << "Merging " << group.size() << " runs into: " <<
+                temp_str << "\n";
+            std::vector<run_range> ranges;
+            for (unsigned int j : group) {
+                ranges.push_back(run_range{j, -1, -1});
+            }
+            {
+                bam_writer writer(temp_str, lhdr);
+                unsigned long lindex = 0;
+                merge_runs(ranges, get_readahead_bytes(group.size(), config.size_lim),
+                    [&](const bam_record& lrec) {
+                        write_run_record(writer, merged_id, lrec, lindex++);
+                    });
+            }
+            next_ids.push_back(merged_id);
+            for (unsigned int j : group) {
+                remove_run(j);
+                run_samples.erase(j);
+            }
+        }
+        std::cout << "Merge pass " << merge_pass << ": " << run_ids.size() <<
+            " runs into " << next_ids.size() << "\n";
+        run_ids = next_ids;
+    }
+}
+
+void umi_norm_engine::merge_files() {
+
+    std::vector<run_sample> splitters = choose_splitters(get_merge_parts());
+    if (!splitters.empty()) {
+        merge_parallel(splitters);
+        return;
+    }
+
+    // The run buffers of the split phase are gone by now, so half of the
+    // memory budget is shared as read-ahead between the runs.
+    unsigned long readahead_bytes = get_readahead_bytes(run_ids.size(),
+        config.size_lim / 2);
+    std::cout << "Read-ahead per run: " << std::to_string(readahead_bytes) << "\n";
+
+    std::vector<run_range> ranges;
+    for (unsigned int j : run_ids) {
+        std::cout << "Opening tempfile for reading: " << get_run_file(j) << "\n";
+        ranges.push_back(run_range{j, -1, -1});
+    }
+    open_parts(1);
+    merge_part& lpart = *parts[0];
+    get_collapser(0);
+    merge_runs(ranges, readahead_bytes, [&](const bam_record& lrec) {
+        if (lrec.is_mapped) {
+            emit_sorted(lpart, lrec);
+        }
+    });
+    finish_parts();
+}
+
+// Number of key ranges of the final pass; every range opens a reader
+// thread per run.
+unsigned int umi_norm_engine::get_merge_parts() {
+    if (!factory || config.merge_parts < 2) {
+        return 1;
+    }
+    if (!config.previous_sorted.empty() && !can_seek_previous()) {
+        return 1;
+    }
+    const size_t max_merge_readers = 1024;
+    size_t lparts = config.merge_parts;
+    if (!run_ids.empty()) {
+        lparts = std::min(lparts, std::max((size_t) 1,
+            max_merge_readers / run_ids.size()));
+    }
+    return lparts;
+}
+
+int umi_norm_engine::compare_group(const run_sample& a, const run_sample& b) {
+    if (a.ref_name_id != b.ref_name_id) {
+        return a.ref_name_id < b.ref_name_id ? -1 : 1;
+    }
+    int umi_c = a.umi.compare(b.umi);
+    if (umi_c != 0) {
+        return umi_c < 0 ? -1 : 1;
+    }
+    if (a.strand != b.strand) {
+        return a.strand < b.strand ? -1 : 1;
+    }
+    return 0;
+}
+
+bool umi_norm_engine::get_raw_key(const bam1_t* lread, size_t umi_len,
+        run_sample& lkey) {
+    char* umi_str = bam_reader::get_umi_str(bam_get_qname(lread), umi_len);
+    lkey.umi = umi_str;
+    delete[] umi_str;
+    lkey.ref_name_id = lread -> core.tid;
+    lkey.strand = bam_is_rev(lread) ? '-' : '+';
+    return true;
+}
+
+// Picks up to num_parts - 1 ref/UMI/strand keys that cut the sampled reads
+// of all runs into ranges of about the same size.
+std::vector<umi_norm_engine::run_sample> umi_norm_engine::choose_splitters(
+        unsigned int num_parts) {
+    std::vector<run_sample> splitters;
+    if (num_parts < 2) {
+        return splitters;
+    }
+    std::vector<run_sample> lkeys;
+    for (unsigned int j : run_ids) {
+        auto lit = run_samples.find(j);
+        if (lit != run_samples.end()) {
+            lkeys.insert(lkeys.end(), lit -> second.begin(), lit -> second.end());
+        }
+    }
+    if (lkeys.size() < num_parts) {
+        return splitters;
+    }
+    std::sort(lkeys.begin(), lkeys.end(),
+        [](const run_sample& a, const run_sample& b) {
+            return compare_group(a, b) < 0;
+        });
+    for (unsigned int p = 1; p < num_parts; p++) {
+        const run_sample& lkey = lkeys[lkeys.size() * p / num_parts];
+        if (compare_group(lkeys.front(), lkey) < 0 &&
+            (splitters.empty() || compare_group(splitters.back(), lkey) < 0)) {
+            splitters.push_back(lkey);
+        }
+    }
+    return splitters;
+}
+
+// Virtual offset in the run of the first read at or after every splitter;
+// no_offset where the run ends before it. The samples of the run bound the
+// reads scanned per splitter.
+std::vector<long> umi_norm_engine::locate_splitters(unsigned int run_id,
+        const std::vector<run_sample>& splitters) {
+    const long no_offset = std::numeric_limits<long>::max();
+    std::string run_str = get_run_file(run_id);
+    bam_reader reader(run_str, "", get_run_ref(run_id));
+    std::vector<run_sample> no_samples;
+    auto lit = run_samples.find(run_id);
+    const std::vector<run_sample>& samples = lit != run_samples.end() ?
+        lit -> second : no_samples;
+
+    std::vector<long> offsets;
+    long lpos = reader.get_virtual_offset();
+    size_t lsample = 0;
+    run_sample lkey;
+    for (const run_sample& lsplit : splitters) {
+        if (lpos == no_offset) {
+            offsets.push_back(no_offset);
+            continue;
+        }
+        while (lsample < samples.size() &&
+            compare_group(samples[lsample], lsplit) < 0) {
+            lsample++;
+        }
+        if (lsample > 0 && samples[lsample - 1].voffset > lpos) {
+            lpos = samples[lsample - 1].voffset;
+        }
+        reader.seek(lpos);
+        while (true) {
+            long lcur = reader.get_virtual_offset();
+            bam1_t* lread = reader.read_raw();
+            if (!lread) {
+                lpos = no_offset;
+                break;
+            }
+            get_raw_key(lread, config.umi_len, lkey);
+            if (compare_group(lkey, lsplit) >= 0) {
+                lpos = lcur;
+                break;
+            }
+        }
+        offsets.push_back(lpos);
+    }
+    return offsets;
+}
+
+// Merges and collapses the key ranges between the splitters in parallel.
+void umi_norm_engine::merge_parallel(const std::vector<run_sample>& splitters) {
+    const long no_offset = std::numeric_limits<long>::max();
+    unsigned int num_parts = splitters.size() + 1;
+
+    std::vector<std::vector<run_range>> part_ranges(num_parts);
+    for (unsigned int j : run_ids) {
+        std::vector<long> offsets = locate_splitters(j, splitters);
+        for (unsigned int p = 0; p < num_parts; p++) {
+            long lstart = p == 0 ? -1 : offsets[p - 1];
+            long lend = p + 1 == num_parts ? -1 : offsets[p];
+            if (lstart == no_offset || (lstart >= 0 && lstart == lend)) {
+                continue;
+            }
+            if (lend == no_offset) {
+                lend = -1;
+            }
+            part_ranges[p].push_back(run_range{j, lstart, lend});
+        }
+    }
+
+    unsigned long readahead_bytes = get_readahead_bytes(
+        run_ids.size() * num_parts, config.size_lim / 2);
+    std::cout << "Merging " << run_ids.size() << " runs in " << num_parts <<
+        " key ranges, read-ahead per run and range: " << readahead_bytes << "\n";
+
+    open_parts(num_parts);
+    run_parts([&](unsigned int p) {
+        merge_part& lpart = *parts[p];
+        get_collapser(p);
+        merge_runs(part_ranges[p], readahead_bytes, [&](const bam_record& lrec) {
+            if (lrec.is_mapped) {
+                emit_sorted(lpart, lrec);
+            }
+        });
+    });
+    finish_parts();
+}
+
+void umi_norm_engine::remove_run(unsigned int run_id) {
+    // The previous sorted bam is an input.
+    if (run_id == 0) {
+        return;
+    }
+    std::string temp_str = get_temp_file(run_id);
+
+    fs::path temp_path(temp_str);
+    if (fs::remove(temp_path)) {
+        std::cout << "Deleted: " << temp_str << "\n";
+    }
+}
+
+// Also removes what is left of an interrupted merge pass.
+void umi_norm_engine::clean() {
+    if (previous_sampler.joinable()) {
+        previous_sampler.join();
+    }
+    for (unsigned int j = 1; j <= last_run_id; j++) {
+        remove_run(j);
+    }
+    run_ids.clear();
+    run_samples.clear();
+    last_run_id = 0;
+}
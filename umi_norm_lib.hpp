@@ -0,0 +1,240 @@
+#ifndef _UMI_NORM_LIB_HPP
+#define _UMI_NORM_LIB_HPP
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <map>
+#include <thread>
+#include <exception>
+#include <htslib/sam.h>
+#include "bam_record.hpp"
+#include "cluster_buffer.hpp"
+#include "umi_collapser.hpp"
+#include "coordinate_stream.hpp"
+#include "collapse_policy.hpp"
+
+class bam_writer;
+class read_filter;
+
+// Called for every mapped read in the sorted (compare_bam_less) order.
+typedef std::function<void(const bam_record&)> record_callback;
+
+// Called for every cluster of the collapse with gap config.sweep_gaps[sweep].
+typedef std::function<void(unsigned int sweep, cluster_buffer&, int)> sweep_callback;
+
+// Callbacks of one key range of a parallel merge, see set_part_factory.
+struct part_callbacks {
+    record_callback record_cb;
+    gap_callback gap_cb;
+    cluster_callback cluster_cb;
+    sweep_callback sweep_cb;
+};
+
+typedef std::function<part_callbacks(unsigned int part)> part_factory;
+
+struct umi_norm_config {
+    // "coordinate" or "feature"
+    std::string coll_str = "coordinate";
+    int brake_gap = 500;
+    // Mode and gap of some references instead of coll_str and brake_gap,
+    // see collapse_policy
+    std::string ref_rules;
+    // Bases of the umi_ field of the qnames; 6, 8, 10 and 12 have
+    // collapse and merge code specialized for them.
+    size_t umi_len = 6;
+    // Choice of the representative read: "hash", "mapq", "longest" or
+    // "random" (see umi_collapser)
+    std::string rep_policy = "hash";
+    unsigned seed = 100;
+    // Memory budget of the sort and of the merge, in bytes
+    unsigned long size_lim = 200000000;
+    // Part of the cluster memory of the merge (half of size_lim) that the
+    // caller uses itself meanwhile, e.g. for the representatives; the
+    // collapsers share the rest.
+    unsigned long reserved_cluster_mem = 0;
+    unsigned int num_threads = 1;
+    // Most runs merged at once; with more runs they are first merged in
+    // groups into longer runs. 0 merges everything in one pass.
+    unsigned int max_fan_in = 0;
+    // Path prefix of the sorted runs and the cluster spill file,
+    // e.g. <outdir>/logdir/<prefix>
+    std::string temp_prefix;
+    // Coordinate collapse of coordinate sorted input without the sort
+    // (see coordinate_stream). No record callback is made in this mode.
+    bool stream_coordinate = false;
+    // Input already in compare_bam_less order, e.g. the _sorted.bam of an
+    // earlier run: reads go straight to the collapse without the sort, and
+    // a read out of order is an error.
+    bool presorted = false;
+    // _sorted.bam of an earlier run over the same references, merged as
+    // one more sorted run with the new reads (top-up of a library).
+    std::string previous_sorted;
+    // Fasta reference to decode previous_sorted when it is a cram
+    std::string ref_str;
+    // Filter of the reads of previous_sorted, the one the new reads went
+    // through, so that both are kept by the same rules; NULL keeps all.
+    const read_filter* previous_filter = NULL;
+    // Most key ranges merged and collapsed in parallel by the final pass;
+    // only used with a part factory.
+    unsigned int merge_parts = 1;
+    // Further gaps collapsed over the same sorted reads, each with clusters
+    // of its own that go to the sweep callback. A sweep gap takes the place
+    // of brake_gap, also for the rules of ref_rules without a gap.
+    std::vector<int> sweep_gaps;
+};
+
+// The sort and collapse pipeline of umi_norm as an embeddable library.
+// Mapped reads are handed over one at a time with add_record, in any
+// order. finish() sorts them (in memory if they fit into the budget,
+// otherwise through sorted runs on disk) and reports every read in sorted
+// order to the record callback and every UMI cluster to the cluster
+// callback. Pairs of consecutive reads of the same ref/UMI/strand are
+// reported to the gap callback. A cluster is reported before the record
+// callback of the first read after it, so the record callback sees the
+// reads of the clusters in runs.
+class umi_norm_engine {
+
+    public:
+
+    umi_norm_engine(const umi_norm_config& config, bam_hdr_t* lhdr);
+    ~umi_norm_engine();
+
+    umi_norm_engine(const umi_norm_engine&) = delete;
+    umi_norm_engine& operator=(const umi_norm_engine&) = delete;
+
+    void set_cluster_callback(cluster_callback callback);
+    void set_record_callback(record_callback callback);
+    void set_gap_callback(gap_callback callback);
+    void set_sweep_callback(sweep_callback callback);
+
+    // With a part factory the final pass may be split into up to
+    // config.merge_parts key ranges that are merged and collapsed on
+    // threads of their own, and the callbacks set above are not used.
+    // factory(p) is called on the calling thread for every range before
+    // the pass starts; the callbacks of range p are made on its thread.
+    // Ranges split at ref/UMI/strand boundaries and the reads of range p
+    // come before those of range p + 1, so concatenating the outputs of
+    // the ranges in order gives the output of a single pass.
+    void set_part_factory(part_factory factory);
+    // Number of ranges of the final pass, known after finish().
+    unsigned int get_num_parts() const;
+
+    // Unmapped reads are ignored.
+    void add_record(bam_record&& lrec);
+    // Decodes an alignment of a file with the header given to the
+    // constructor.
+    void add_record(const bam1_t* lread);
+
+    void finish();
+
+    private:
+
+    // Collapse state of one key range
+    struct merge_part {
+        part_callbacks callbacks;
+        std::unique_ptr<umi_collapser> collapser;
+        // One by sweep gap
+        std::vector<std::unique_ptr<umi_collapser>> sweep_collapsers;
+        // Previous read of the sorted order, for the gap callback
+        bam_record prev_rec;
+        bool has_prev = false;
+        unsigned long mapped_count = 0;
+    };
+
+    // Part of a run between two virtual offsets (-1 for the start and the
+    // end of the file).
+    struct run_range {
+        unsigned int run_id;
+        long start_offset;
+        long end_offset;
+    };
+
+    // Group key (ref, UMI, strand) of a read of a run and the virtual
+    // offset of the read.
+    struct run_sample {
+        int ref_name_id;
+        std::string umi;
+        char strand;
+        long voffset;
+    };
+
+    std::string get_temp_file(unsigned int count);
+    std::string get_run_file(unsigned int run_id);
+    std::string get_run_ref(unsigned int run_id);
+    const read_filter* get_run_filter(unsigned int run_id);
+    void check_previous_header();
+    bool can_seek_previous();
+    void sample_previous();
+    void join_previous_sampler();
+    void add_presorted(bam_record&& lrec);
+    void dump_run();
+    void dump_sorted_records(std::vector<bam_record>& brvec,
+        unsigned int temp_count);
+    void write_run_record(bam_writer& writer, unsigned int run_id,
+        const bam_record& lrec, unsigned long index);
+    unsigned long get_readahead_bytes(size_t num_runs, unsigned long budget);
+    unsigned long get_cluster_mem_bytes();
+    void open_parts(unsigned int num_parts);
+    umi_collapser& get_collapser(unsigned int part);
+    void emit_sorted(merge_part& lpart, const bam_record& lrec);
+    void finish_parts();
+    void run_parts(std::function<void(unsigned int)> body);
+    void collapse_in_memory();
+    void merge_runs(const std::vector<run_range>& ranges,
+        unsigned long readahead_bytes, record_callback sink);
+    template <size_t UMI_LEN>
+    void merge_runs_fixed(const std::vector<run_range>& ranges,
+        unsigned long readahead_bytes, record_callback& sink);
+    void reduce_runs();
+    void merge_files();
+    unsigned int get_merge_parts();
+    std::vector<run_sample> choose_splitters(unsigned int num_parts);
+    std::vector<long> locate_splitters(unsigned int run_id,
+        const std::vector<run_sample>& splitters);
+    void merge_parallel(const std::vector<run_sample>& splitters);
+    static bool get_raw_key(const bam1_t* lread, size_t umi_len,
+        run_sample& lkey);
+    static int compare_group(const run_sample& a, const run_sample& b);
+    void remove_run(unsigned int run_id);
+    void clean();
+
+    // Fewest reads per range of the in-memory collapse
+    static const size_t min_part_reads = 100000;
+    // Reads of a run per sample for the splitters
+    static const unsigned long sample_interval = 4096;
+
+    umi_norm_config config;
+    bam_hdr_t* lhdr = NULL;
+    // Resolved against lhdr in the constructor
+    collapse_policy coll_policy;
+    std::vector<collapse_policy> sweep_policies;
+    cluster_callback cluster_cb;
+    record_callback record_cb;
+    gap_callback gap_cb;
+    sweep_callback sweep_cb;
+    part_factory factory;
+    std::vector<std::unique_ptr<merge_part>> parts;
+    std::unique_ptr<coordinate_stream> stream;
+    std::vector<bam_record> brvec;
+    unsigned long used_size = 0;
+    // Ids of the sorted runs on disk, see get_run_file
+    std::vector<unsigned int> run_ids;
+    unsigned int last_run_id = 0;
+    // Previous read of presorted input, for the order check
+    bam_record last_presorted;
+    bool has_presorted = false;
+    // Every sample_interval-th read of every run, by run id
+    std::map<unsigned int, std::vector<run_sample>> run_samples;
+    // Samples of the previous sorted bam (run 0), taken on a thread of
+    // their own during the split phase
+    std::thread previous_sampler;
+    std::vector<run_sample> previous_samples;
+    std::exception_ptr previous_error;
+    unsigned long read_counter = 0;
+    bool finished = false;
+
+};
+
+#endif